@@ -0,0 +1,615 @@
+#include <uwsgi.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cmath>
+#include <cstring>
+#include <bson/bson.h>
+#include "json.hpp"
+#include "fnv.h"
+#include "stats.h"
+
+// Below this many workers, splitting the conversion costs more than it saves
+#define CONVERT_MIN_WORKERS 32
+
+/**
+ * The conversion thread pool. It is allocated on first use and never
+ * freed: its threads are detached and still wait on it when the process
+ * exits, and destroying a condition variable they wait on would block
+ * the exit.
+ */
+struct convert_pool {
+    int threads;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::condition_variable done_cv;
+    std::deque<std::function<void()>> tasks;
+    std::size_t pending;
+};
+
+static convert_pool *pool = NULL;
+
+static void pool_loop() {
+    sigset_t smask;
+    sigfillset(&smask);
+    pthread_sigmask(SIG_BLOCK, &smask, NULL);
+
+    for (;;) {
+        std::unique_lock<std::mutex> lock(pool->lock);
+        pool->cv.wait(lock, [] { return !pool->tasks.empty(); });
+        std::function<void()> task = std::move(pool->tasks.front());
+        pool->tasks.pop_front();
+        lock.unlock();
+
+        task();
+
+        lock.lock();
+        if (--pool->pending == 0) {
+            pool->done_cv.notify_all();
+        }
+    }
+}
+
+/**
+ * Runs the tasks on the conversion thread pool, started on first use with
+ * 'threads' threads, and waits for all of them to finish.
+ */
+static void pool_run(std::vector<std::function<void()>> &tasks, int threads) {
+    if (!pool) {
+        pool = new convert_pool();
+    }
+    std::unique_lock<std::mutex> lock(pool->lock);
+    for (; pool->threads < threads; pool->threads++) {
+        std::thread(pool_loop).detach();
+    }
+    for (auto &task : tasks) {
+        pool->tasks.push_back(std::move(task));
+    }
+    pool->pending += tasks.size();
+    pool->cv.notify_all();
+    pool->done_cv.wait(lock, [] { return pool->pending == 0; });
+}
+
+
+/**
+ * A leaf of the document, as the BSON type it is encoded as: integers
+ * that fit take an int32, and non-finite doubles, which json dumps as
+ * null, are null, as bson_new_from_json() had them.
+ */
+struct bson_leaf {
+    bson_type_t type;
+    union {
+        int64_t i;
+        double d;
+        bool b;
+    };
+    const std::string *s;
+};
+
+static bool convert_error(bson_error_t *error, const char *reason, const char *key, size_t len) {
+    if (error) {
+        bson_set_error(error, BSON_ERROR_INVALID, BSON_ERROR_INVALID, "%s: %.*s", reason,
+            (int)std::min(len, (size_t)64), key ? key : "");
+    }
+    return false;
+}
+
+static void leaf_int(bson_leaf &leaf, int64_t v) {
+    leaf.type = (v >= INT32_MIN && v <= INT32_MAX) ? BSON_TYPE_INT32 : BSON_TYPE_INT64;
+    leaf.i = v;
+}
+
+// BSON has no unsigned integers: those past INT64_MAX cannot be stored
+static bool leaf_of_json(const json &node, bson_leaf &leaf) {
+    switch (node.type()) {
+    case json::value_t::boolean:
+        leaf.type = BSON_TYPE_BOOL;
+        leaf.b = node.get<bool>();
+        return true;
+    case json::value_t::string:
+        leaf.type = BSON_TYPE_UTF8;
+        leaf.s = &node.get_ref<const std::string &>();
+        return true;
+    case json::value_t::number_float:
+        leaf.d = node.get<double>();
+        leaf.type = std::isfinite(leaf.d) ? BSON_TYPE_DOUBLE : BSON_TYPE_NULL;
+        return true;
+    case json::value_t::number_integer:
+        leaf_int(leaf, node.get<int64_t>());
+        return true;
+    case json::value_t::number_unsigned:
+        if (node.get<uint64_t>() > (uint64_t)INT64_MAX) return false;
+        leaf_int(leaf, (int64_t)node.get<uint64_t>());
+        return true;
+    default:
+        leaf.type = BSON_TYPE_NULL;
+        return true;
+    }
+}
+
+// The key of array element i, in buf
+static size_t index_key(size_t i, char *buf) {
+    char digits[24];
+    size_t len = 0;
+    do {
+        digits[len++] = '0' + i % 10;
+        i /= 10;
+    } while (i);
+    for (size_t j = 0; j < len; j++) buf[j] = digits[len - 1 - j];
+    buf[len] = 0;
+    return len;
+}
+
+/**
+ * The walk of a snapshot, in the order json dumps it (object keys sorted,
+ * which typed objects follow through the order of their schema), feeding
+ * a sink with its containers and leaves:
+ *
+ *     bool begin(key, len, implied, type, count)  a document or an array
+ *     void end()
+ *     bool leaf(key, len, implied, leaf)
+ *     bool typed(key, len, implied, object)       a typed object
+ *
+ * A NULL key is the root document. 'implied' keys follow from the shape
+ * alone: array indexes and the fields of typed objects.
+ */
+template <typename Sink>
+static bool walk_json(Sink &sink, const char *key, size_t len, bool implied, const json &node) {
+    if (node.is_object()) {
+        if (!sink.begin(key, len, implied, BSON_TYPE_DOCUMENT, node.size())) return false;
+        for (auto it = node.begin(); it != node.end(); ++it) {
+            const std::string &name = it.key();
+            if (!walk_json(sink, name.data(), name.size(), false, *it)) return false;
+        }
+        sink.end();
+        return true;
+    }
+    if (node.is_array()) {
+        if (!sink.begin(key, len, implied, BSON_TYPE_ARRAY, node.size())) return false;
+        char buf[24];
+        for (size_t i = 0; i < node.size(); i++) {
+            if (!walk_json(sink, buf, index_key(i, buf), true, node[i])) return false;
+        }
+        sink.end();
+        return true;
+    }
+
+    bson_leaf leaf;
+    if (!leaf_of_json(node, leaf)) {
+        return convert_error(sink.error, "integer out of the range of int64", key, len);
+    }
+    return sink.leaf(key, len, implied, leaf);
+}
+
+template <typename Sink>
+static bool walk_object(Sink &sink, const char *key, size_t len, bool implied,
+        const stats_object &obj);
+
+template <typename Sink>
+static bool walk_field(Sink &sink, const stats_object &obj, const stats_field *field) {
+    int i = field - obj.schema->fields;
+    bson_leaf leaf;
+    char buf[24];
+
+    switch (field->kind) {
+    case FIELD_INT:
+        if (obj.negative & (1u << i)) {
+            leaf_int(leaf, (int64_t)obj.ints[i]);
+        } else if (obj.ints[i] > (uint64_t)INT64_MAX) {
+            return convert_error(sink.error, "integer out of the range of int64",
+                field->name, field->len);
+        } else {
+            leaf_int(leaf, (int64_t)obj.ints[i]);
+        }
+        return sink.leaf(field->name, field->len, true, leaf);
+    case FIELD_STRING:
+        leaf.type = BSON_TYPE_UTF8;
+        leaf.s = &obj.strings[field->slot];
+        return sink.leaf(field->name, field->len, true, leaf);
+    case FIELD_OBJECTS: {
+        const std::vector<stats_object> &list = obj.children[field->slot];
+        if (!sink.begin(field->name, field->len, true, BSON_TYPE_ARRAY, list.size())) {
+            return false;
+        }
+        for (size_t j = 0; j < list.size(); j++) {
+            if (!walk_object(sink, buf, index_key(j, buf), true, list[j])) return false;
+        }
+        sink.end();
+        return true;
+    }
+    case FIELD_EMPTY_ARRAY:
+    case FIELD_EMPTY_OBJECT:
+        if (!sink.begin(field->name, field->len, true,
+                field->kind == FIELD_EMPTY_ARRAY ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT, 0)) {
+            return false;
+        }
+        sink.end();
+        return true;
+    }
+    return true;
+}
+
+// The fields in their slots and the keys in 'extra', merged in key order
+template <typename Sink>
+static bool walk_object(Sink &sink, const char *key, size_t len, bool implied,
+        const stats_object &obj) {
+    const stats_schema *schema = obj.schema;
+    if (!sink.typed(key, len, implied, obj)) return false;
+
+    auto extra = obj.extra.cbegin();
+    auto extra_end = obj.extra.cend();
+    int k = 0;
+    for (;;) {
+        while (k < schema->count && !(obj.present & (1u << schema->order[k]))) k++;
+        const stats_field *field = k < schema->count ? &schema->fields[schema->order[k]] : NULL;
+        if (extra != extra_end && (!field || extra.key().compare(field->name) < 0)) {
+            const std::string &name = extra.key();
+            if (!walk_json(sink, name.data(), name.size(), false, *extra)) return false;
+            ++extra;
+        } else if (field) {
+            if (!walk_field(sink, obj, field)) return false;
+            k++;
+        } else {
+            break;
+        }
+    }
+    sink.end();
+    return true;
+}
+
+template <typename Sink>
+static bool walk_workers(Sink &sink, const std::vector<stats_object> &workers, size_t first,
+        size_t last) {
+    char buf[24];
+    for (size_t i = first; i < last; i++) {
+        if (!walk_object(sink, buf, index_key(i, buf), true, workers[i])) return false;
+    }
+    return true;
+}
+
+/**
+ * Walks the document of a snapshot, with its typed workers in the place
+ * of its "workers" key, emitted by 'workers' once begin() opened their
+ * array.
+ */
+template <typename Sink, typename Workers>
+static bool walk_snapshot(Sink &sink, const stats_snapshot &snap, Workers workers) {
+    const json &doc = snap.doc;
+    if (!snap.typed) {
+        if (!doc.is_object() && !doc.is_array()) {
+            return convert_error(sink.error, "not a document", "", 0);
+        }
+        return walk_json(sink, NULL, 0, true, doc);
+    }
+
+    bool done = false;
+    auto emit_workers = [&] {
+        done = true;
+        if (!sink.begin("workers", 7, false, BSON_TYPE_ARRAY, snap.workers.size())) return false;
+        if (!workers()) return false;
+        sink.end();
+        return true;
+    };
+    if (!sink.begin(NULL, 0, true, BSON_TYPE_DOCUMENT, doc.size() + 1)) return false;
+    for (auto it = doc.begin(); it != doc.end(); ++it) {
+        const std::string &name = it.key();
+        if (!done && name.compare("workers") > 0 && !emit_workers()) return false;
+        if (!walk_json(sink, name.data(), name.size(), false, *it)) return false;
+    }
+    if (!done && !emit_workers()) return false;
+    sink.end();
+    return true;
+}
+
+/**
+ * Writes BSON. Containers get their length once they are closed. When
+ * 'offsets' is set, it gets the offset of the payload of every leaf (for
+ * strings, of the characters, past the length prefix), in walk order.
+ */
+struct bson_sink {
+    std::string buf;
+    std::vector<size_t> open;
+    std::vector<uint32_t> *offsets;
+    bson_error_t *error;
+
+    bson_sink(std::vector<uint32_t> *offsets, bson_error_t *error)
+        : offsets(offsets), error(error) {}
+
+    void put32(uint32_t v) {
+        v = BSON_UINT32_TO_LE(v);
+        buf.append((const char *)&v, sizeof(v));
+    }
+
+    bool element(bson_type_t type, const char *key, size_t len) {
+        if (!key) return true;
+        if (memchr(key, 0, len)) return convert_error(error, "key with a NUL byte", key, len);
+        buf += (char)type;
+        buf.append(key, len);
+        buf += '\0';
+        return true;
+    }
+
+    bool begin(const char *key, size_t len, bool implied, bson_type_t type, size_t count) {
+        if (!element(type, key, len)) return false;
+        open.push_back(buf.size());
+        put32(0);
+        return true;
+    }
+
+    bool typed(const char *key, size_t len, bool implied, const stats_object &obj) {
+        return begin(key, len, implied, BSON_TYPE_DOCUMENT, 0);
+    }
+
+    void end() {
+        buf += '\0';
+        uint32_t size = BSON_UINT32_TO_LE((uint32_t)(buf.size() - open.back()));
+        memcpy(&buf[open.back()], &size, sizeof(size));
+        open.pop_back();
+    }
+
+    bool leaf(const char *key, size_t len, bool implied, const bson_leaf &leaf) {
+        if (!element(leaf.type, key, len)) return false;
+        if (offsets) {
+            offsets->push_back(buf.size() + (leaf.type == BSON_TYPE_UTF8 ? 4 : 0));
+        }
+        switch (leaf.type) {
+        case BSON_TYPE_INT32:
+            put32((uint32_t)(int32_t)leaf.i);
+            break;
+        case BSON_TYPE_INT64: {
+            uint64_t v = BSON_UINT64_TO_LE((uint64_t)leaf.i);
+            buf.append((const char *)&v, sizeof(v));
+            break;
+        }
+        case BSON_TYPE_DOUBLE: {
+            double v = BSON_DOUBLE_TO_LE(leaf.d);
+            buf.append((const char *)&v, sizeof(v));
+            break;
+        }
+        case BSON_TYPE_BOOL:
+            buf += (char)(leaf.b ? 1 : 0);
+            break;
+        case BSON_TYPE_UTF8:
+            put32((uint32_t)leaf.s->size() + 1);
+            buf.append(*leaf.s);
+            buf += '\0';
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    // Appends the elements another sink wrote, with the offsets of its leaves
+    void append(const bson_sink &other) {
+        if (offsets) {
+            for (uint32_t offset : *other.offsets) {
+                offsets->push_back(buf.size() + offset);
+            }
+        }
+        buf += other.buf;
+    }
+};
+
+/**
+ * Converts a snapshot to BSON, appending the offsets of its leaves to
+ * 'offsets' if set. With more than one thread and enough workers, the
+ * workers, which are independent and make up most of the document, are
+ * written in parallel chunks, then stitched into the workers array.
+ */
+static bson_t *convert(const stats_snapshot &snap, int threads, bson_error_t *error,
+        std::vector<uint32_t> *offsets) {
+    bson_sink sink(offsets, error);
+    std::size_t count = snap.workers.size();
+
+    bool ok = walk_snapshot(sink, snap, [&] {
+        if (threads <= 1 || count < CONVERT_MIN_WORKERS) {
+            return walk_workers(sink, snap.workers, 0, count);
+        }
+        std::size_t chunk = (count + threads - 1) / threads;
+        std::vector<bson_error_t> errors(threads);
+        std::vector<std::vector<uint32_t>> chunk_offsets(threads);
+        std::vector<bson_sink> chunks;
+        std::vector<char> done(threads, 0);
+        std::vector<std::function<void()>> tasks;
+        chunks.reserve(threads);
+        for (int t = 0; t < threads; t++) {
+            chunks.emplace_back(offsets ? &chunk_offsets[t] : NULL, &errors[t]);
+        }
+        for (int t = 0; t < threads && t * chunk < count; t++) {
+            std::size_t first = t * chunk;
+            std::size_t last = std::min(first + chunk, count);
+            tasks.push_back([&, t, first, last] {
+                done[t] = walk_workers(chunks[t], snap.workers, first, last);
+            });
+        }
+        std::size_t used = tasks.size();
+        pool_run(tasks, threads);
+        for (std::size_t t = 0; t < used; t++) {
+            if (!done[t]) {
+                if (error) *error = errors[t];
+                return false;
+            }
+            sink.append(chunks[t]);
+        }
+        return true;
+    });
+    if (!ok) return NULL;
+
+    bson_t *bson = bson_new_from_data((const uint8_t *)sink.buf.data(), sink.buf.size());
+    if (!bson) {
+        convert_error(error, "document too large", "", 0);
+    }
+    return bson;
+}
+
+/**
+ * The shape of a document: a serialization of its keys, container sizes,
+ * leaf types and string lengths, and its hash for a quick comparison. Two
+ * documents with the same shape encode to BSON of the same layout,
+ * differing only in the leaf payloads.
+ */
+struct doc_shape {
+    uint64_t hash;
+    std::string sig;
+
+    bool operator==(const doc_shape &other) const {
+        return hash == other.hash && sig == other.sig;
+    }
+};
+
+/**
+ * Builds the shape of a document and collects its leaves. Typed objects
+ * mix their schema and the fields they hold rather than their keys.
+ */
+struct shape_sink {
+    std::string &sig;
+    std::vector<bson_leaf> &leaves;
+    bson_error_t *error;
+
+    void mix(const void *data, size_t len) {
+        sig.append((const char *)data, len);
+    }
+
+    void mix_key(const char *key, size_t len, bool implied) {
+        if (key && !implied) mix(key, len + 1);
+    }
+
+    bool begin(const char *key, size_t len, bool implied, bson_type_t type, size_t count) {
+        mix_key(key, len, implied);
+        unsigned char tag = type;
+        mix(&tag, 1);
+        mix(&count, sizeof(count));
+        return true;
+    }
+
+    bool typed(const char *key, size_t len, bool implied, const stats_object &obj) {
+        mix_key(key, len, implied);
+        unsigned char tag = 't';
+        mix(&tag, 1);
+        mix(&obj.schema, sizeof(obj.schema));
+        mix(&obj.present, sizeof(obj.present));
+        return true;
+    }
+
+    void end() {
+        unsigned char tag = 0;
+        mix(&tag, 1);
+    }
+
+    bool leaf(const char *key, size_t len, bool implied, const bson_leaf &leaf) {
+        mix_key(key, len, implied);
+        unsigned char tag = leaf.type;
+        mix(&tag, 1);
+        if (leaf.type == BSON_TYPE_UTF8) {
+            size_t size = leaf.s->size();
+            mix(&size, sizeof(size));
+        }
+        leaves.push_back(leaf);
+        return true;
+    }
+};
+
+/**
+ * The BSON of the last full conversion of a shape seen on two pushes in a
+ * row, with the offset of every leaf payload in it. 'last' is the shape
+ * of the previous push.
+ */
+static struct {
+    doc_shape shape;
+    doc_shape last;
+    bson_t *bson;
+    std::vector<uint32_t> offsets;
+} tmpl;
+
+/**
+ * Writes the current leaf values over the template payloads, at their
+ * compiled offsets.
+ */
+static void patch(const std::vector<bson_leaf> &leaves) {
+    uint8_t *data = (uint8_t *)bson_get_data(tmpl.bson);
+
+    for (size_t i = 0; i < leaves.size(); i++) {
+        const bson_leaf &leaf = leaves[i];
+        uint8_t *p = data + tmpl.offsets[i];
+        switch (leaf.type) {
+        case BSON_TYPE_INT32: {
+            int32_t v = BSON_UINT32_TO_LE((uint32_t)leaf.i);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        case BSON_TYPE_INT64: {
+            int64_t v = BSON_UINT64_TO_LE((uint64_t)leaf.i);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        case BSON_TYPE_DOUBLE: {
+            double v = BSON_DOUBLE_TO_LE(leaf.d);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        case BSON_TYPE_BOOL:
+            *p = leaf.b ? 1 : 0;
+            break;
+        case BSON_TYPE_UTF8:
+            memcpy(p, leaf.s->data(), leaf.s->size());
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * Converts the stats snapshot to BSON, with the keys of each object in
+ * the order json keeps them, as bson_new_from_json() had them from its
+ * dump, and the same types: integers that fit take an int32, and
+ * non-finite doubles are null. Fails, setting 'error', on unsigned
+ * integers past INT64_MAX and keys holding a NUL byte.
+ *
+ * Between pushes the shape of the document almost never changes, only its
+ * values do. The conversion of a shape seen on the previous push is kept
+ * as a template with the offset of every leaf; while the shape stays the
+ * same, later pushes write the new values over the template and copy it.
+ * A new shape (workers, cores or metrics added or gone, an integer
+ * outgrowing int32, a string changing length) gets a full conversion, and
+ * a new template once the same shape comes back on the next push:
+ * documents whose shape changes on every push (e.g. with sparse workers,
+ * latency buckets, routes or slow samples) are converted without paying
+ * for a template each time.
+ */
+bson_t *stats_to_bson(const stats_snapshot &snap, int threads, bson_error_t *error) {
+    doc_shape shape;
+    std::vector<bson_leaf> leaves;
+    shape_sink sink = {shape.sig, leaves, NULL};
+
+    if (!walk_snapshot(sink, snap, [&] {
+            return walk_workers(sink, snap.workers, 0, snap.workers.size());
+        })) {
+        tmpl.last = doc_shape();
+        return convert(snap, threads, error, NULL);
+    }
+    shape.hash = fnv1a_64(shape.sig.data(), shape.sig.size());
+    if (tmpl.bson && tmpl.shape == shape) {
+        tmpl.last = std::move(shape);
+        patch(leaves);
+        return bson_copy(tmpl.bson);
+    }
+
+    std::vector<uint32_t> offsets;
+    bool compile = tmpl.last == shape;
+    bson_t *bson = convert(snap, threads, error, compile ? &offsets : NULL);
+    if (bson && compile) {
+        if (tmpl.bson) bson_destroy(tmpl.bson);
+        tmpl.bson = bson_copy(bson);
+        tmpl.shape = shape;
+        tmpl.offsets.swap(offsets);
+    }
+    tmpl.last = std::move(shape);
+    return bson;
+}
@@ -0,0 +1,139 @@
+#include <uwsgi.h>
+#include <string>
+#include <map>
+#include "json.hpp"
+#include "stats.h"
+
+typedef std::map<std::string, uint64_t> worker_counters;
+typedef std::map<int64_t, worker_counters> counter_state;
+
+static const struct {
+    const char *key;
+    int field;
+} counter_fields[] = {
+    {"requests", WORKER_REQUESTS}, {"exceptions", WORKER_EXCEPTIONS}, {"tx", WORKER_TX},
+    {"harakiri_count", WORKER_HARAKIRI_COUNT}, {NULL, 0},
+};
+
+// Worker counters of the current and of the previous push
+static counter_state current_counters;
+static counter_state previous_counters;
+// Counters the last $inc written to the counters collection accounts for
+static counter_state committed_counters;
+static counter_state pending_counters;
+static bool have_baseline = false;
+
+/**
+ * Returns the increment of a monotonic counter since the previous push.
+ *
+ * uWSGI keeps worker counters across respawns, but a counter that goes
+ * backwards (a master reload, a worker slot reused after a respawn that
+ * did reset it) has started over from zero, so its current value is the
+ * whole increment.
+ */
+static uint64_t counter_delta(uint64_t prev, uint64_t cur) {
+    return (cur >= prev) ? cur - prev : cur;
+}
+
+// A worker id not in 'state' counts from zero
+static uint64_t counter_of(const counter_state &state, int64_t id, const char *key) {
+    auto last = state.find(id);
+    if (last == state.end()) {
+        return 0;
+    }
+    auto value = last->second.find(key);
+    return value != last->second.end() ? value->second : 0;
+}
+
+/**
+ * Records the worker counters of a stats snapshot, e.g. those of worker 1
+ * as {"requests": 1042, "exceptions": 3, "tx": 8812001, "harakiri_count": 0}.
+ * Called once per push, before counter_deltas() and counter_since_push().
+ */
+void counter_snapshot(const stats_snapshot &snap) {
+    counter_state counters;
+    std::vector<stats_object> scratch;
+
+    for (auto &worker : stats_workers(snap, scratch)) {
+        if (!stats_has(worker, WORKER_ID)) {
+            continue;
+        }
+        worker_counters &wc = counters[stats_int(worker, WORKER_ID)];
+        for (auto *counter = counter_fields; counter->key; counter++) {
+            wc[counter->key] = stats_uint(worker, counter->field);
+        }
+    }
+    previous_counters.swap(current_counters);
+    current_counters.swap(counters);
+}
+
+/**
+ * Sets 'delta' to the increment of a counter of worker 'id' between the
+ * previous push and the current one. Returns false, leaving 'delta' as it
+ * is, when the previous snapshot does not have the worker (on the first
+ * push, or for a worker added since): its counters would be lifetime
+ * totals, not increments.
+ */
+bool counter_since_push(int64_t id, const char *key, uint64_t *delta) {
+    if (!previous_counters.count(id)) {
+        return false;
+    }
+    *delta = counter_delta(counter_of(previous_counters, id, key),
+        counter_of(current_counters, id, key));
+    return true;
+}
+
+/**
+ * Computes the $inc document for the counters collection from the current
+ * snapshot, e.g.
+ *
+ *     {
+ *         "requests": 12, "exceptions": 0, "tx": 81920, "harakiri_count": 0,
+ *         "workers.1.requests": 7, "workers.2.requests": 5
+ *     }
+ *
+ * Totals are the sum of the per-worker deltas; per-worker keys use the
+ * uWSGI worker id. Deltas are taken against the counters of the last
+ * $inc committed with counter_deltas_commit(), so the increments of a
+ * push whose write failed are carried over to the next one. The first
+ * snapshot seen only records the baseline, so counters accumulated before
+ * the pusher started are not attributed to the current bucket, and an
+ * empty object is returned.
+ */
+json counter_deltas() {
+    json inc = json::object();
+    std::map<std::string, uint64_t> totals;
+
+    pending_counters = current_counters;
+    if (!have_baseline) {
+        // Committing the empty $inc of the baseline leaves it as it is
+        committed_counters = pending_counters;
+        have_baseline = true;
+        return inc;
+    }
+
+    for (auto &worker : current_counters) {
+        for (auto *counter = counter_fields; counter->key; counter++) {
+            const char *key = counter->key;
+            uint64_t delta = counter_delta(
+                counter_of(committed_counters, worker.first, key), worker.second[key]);
+            totals[key] += delta;
+            if (counter->field == WORKER_REQUESTS && delta) {
+                inc["workers." + std::to_string(worker.first) + ".requests"] = delta;
+            }
+        }
+    }
+    for (auto *counter = counter_fields; counter->key; counter++) {
+        inc[counter->key] = totals[counter->key];
+    }
+    return inc;
+}
+
+/**
+ * Makes the counters of the last counter_deltas() the new baseline, once
+ * its $inc has been written.
+ */
+void counter_deltas_commit() {
+    committed_counters.swap(pending_counters);
+    pending_counters.clear();
+}
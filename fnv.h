@@ -0,0 +1,38 @@
+#ifndef STATS_PUSHER_MONGODB_FNV_H
+#define STATS_PUSHER_MONGODB_FNV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * FNV-1a, the hash of the plugin wherever one is needed: route slots,
+ * template shapes, stats keys (at compile time too), push phases and
+ * hashed ids.
+ */
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define FNV32_OFFSET 2166136261u
+#define FNV32_PRIME 16777619u
+
+static inline uint64_t fnv1a_64(const char *data, size_t len) {
+    uint64_t hash = FNV64_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * FNV64_PRIME;
+    }
+    return hash;
+}
+
+// Of a NUL-terminated string, usable in constant expressions
+static constexpr uint64_t fnv1a_64_str(const char *s, uint64_t hash = FNV64_OFFSET) {
+    return *s ? fnv1a_64_str(s + 1, (hash ^ (unsigned char)*s) * FNV64_PRIME) : hash;
+}
+
+static inline uint32_t fnv1a_32(const char *data, size_t len) {
+    uint32_t hash = FNV32_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * FNV32_PRIME;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include "json.hpp"
+using json = nlohmann::json;
+
+extern struct uwsgi_server uwsgi;
+
+/**
+ * Log-linear histogram of request durations in microseconds: values below
+ * 8 have a bucket each, and every power of two above is split into 8
+ * buckets, so a bucket is at most 12.5% wide. 38 powers of two reach
+ * about 25 days; longer requests land in the last bucket.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUB + 38 * LATENCY_SUB)
+
+struct latency_counts {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t sum_us;
+};
+
+// One histogram per worker id (0 unused), in memory shared with the master
+static struct latency_counts *histograms = NULL;
+static int histograms_count = 0;
+// What the pusher has already reported, per worker
+static std::vector<latency_counts> reported;
+
+static inline int latency_bucket(uint64_t us) {
+    if (us < LATENCY_SUB) return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int idx = (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+        (int)((us >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+// Highest duration falling in a bucket
+static uint64_t latency_bucket_max(int idx) {
+    if (idx < LATENCY_SUB) return idx;
+    int e = idx / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    uint64_t sub = idx % LATENCY_SUB;
+    uint64_t width = 1ULL << (e - LATENCY_SUB_BITS);
+    return ((LATENCY_SUB + sub) << (e - LATENCY_SUB_BITS)) + width - 1;
+}
+
+/**
+ * after_request hook: records the duration of the request that just ended
+ * into the histogram of the current worker. Cores of a worker record
+ * concurrently, hence the (relaxed) atomic increments: one for the
+ * bucket, one for the sum.
+ */
+extern "C" void stats_pusher_mongodb_after_request(struct wsgi_request *wsgi_req) {
+    if (uwsgi.mywid <= 0 || uwsgi.mywid >= histograms_count ||
+            wsgi_req->end_of_request < wsgi_req->start_of_request) {
+        return;
+    }
+
+    uint64_t us = wsgi_req->end_of_request - wsgi_req->start_of_request;
+    struct latency_counts *h = &histograms[uwsgi.mywid];
+    __atomic_fetch_add(&h->buckets[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+}
+
+/**
+ * Allocates the per-worker histograms in shared memory and registers the
+ * after_request hook. Must run in the master before the workers fork.
+ */
+void latency_init() {
+    struct uwsgi_string_list *usl;
+
+    histograms_count = uwsgi.numproc + 1;
+    histograms = (struct latency_counts *)uwsgi_calloc_shared(
+        sizeof(struct latency_counts) * histograms_count);
+    reported.assign(histograms_count, latency_counts());
+
+    // uWSGI resolves after_request hooks by symbol name at startup, so the
+    // hook is exported under the name it is registered with
+    usl = uwsgi_string_new_list(&uwsgi.after_request_hooks,
+        (char *)"stats_pusher_mongodb_after_request");
+    usl->custom_ptr = (void *)stats_pusher_mongodb_after_request;
+}
+
+/**
+ * Merges what the workers recorded since the previous push into one
+ * histogram, returned as
+ *
+ *     {
+ *         "count": 1843, "sum_us": 30921877,
+ *         "p50_us": 9215, "p90_us": 36863, "p99_us": 98303,
+ *         "p999_us": 245759, "max_us": 327679,
+ *         "buckets": [[511, 12], [575, 40], ...]
+ *     }
+ *
+ * where each bucket is [highest duration in the bucket, requests], for
+ * the non-empty buckets only, and percentiles are the highest duration of
+ * the bucket they fall in. Returns null without requests.
+ */
+json latency_histogram() {
+    if (!histograms) {
+        return nullptr;
+    }
+
+    latency_counts merged = latency_counts();
+    uint64_t count = 0;
+    for (int w = 1; w < histograms_count; w++) {
+        latency_counts &last = reported[w];
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            uint64_t cur = __atomic_load_n(&histograms[w].buckets[i], __ATOMIC_RELAXED);
+            merged.buckets[i] += cur - last.buckets[i];
+            count += cur - last.buckets[i];
+            last.buckets[i] = cur;
+        }
+        uint64_t sum = __atomic_load_n(&histograms[w].sum_us, __ATOMIC_RELAXED);
+        merged.sum_us += sum - last.sum_us;
+        last.sum_us = sum;
+    }
+    if (!count) {
+        return nullptr;
+    }
+
+    json doc = {{"count", count}, {"sum_us", merged.sum_us}};
+    json buckets = json::array();
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        {"p50_us", 0.50}, {"p90_us", 0.90}, {"p99_us", 0.99}, {"p999_us", 0.999},
+    };
+    size_t p = 0;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (!merged.buckets[i]) continue;
+        seen += merged.buckets[i];
+        buckets.push_back({latency_bucket_max(i), merged.buckets[i]});
+        for (; p < sizeof(percentiles) / sizeof(percentiles[0]) &&
+                seen >= percentiles[p].q * count; p++) {
+            doc[percentiles[p].name] = latency_bucket_max(i);
+        }
+        doc["max_us"] = latency_bucket_max(i);
+    }
+    doc["buckets"] = std::move(buckets);
+    return doc;
+}
@@ -0,0 +1,481 @@
+#include <uwsgi.h>
+#include <string>
+#include <cstring>
+#include <vector>
+#include "json.hpp"
+#include "stats.h"
+
+const char *scan_string(const char *p, const char *end);
+const char *scan_ws(const char *p, const char *end);
+bool scan_digits8(const char *p, uint64_t &value);
+
+// The stats document nests a few levels; anything deeper is not uWSGI's
+#define PARSE_MAX_DEPTH 32
+
+/**
+ * Recursive descent parser for the stats JSON. Any input it does not
+ * handle, valid or not, makes it give up, and the caller parses the
+ * document with json::parse() instead, which also reports the errors.
+ */
+struct stats_parser {
+    const char *p;
+    const char *end;
+
+    void skip_ws() {
+        p = scan_ws(p, end);
+    }
+
+    bool literal(const char *word, size_t len) {
+        if ((size_t)(end - p) < len || memcmp(p, word, len)) return false;
+        p += len;
+        return true;
+    }
+
+    static void append_utf8(std::string &out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xc0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += (char)(0xe0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3f));
+            out += (char)(0x80 | (cp & 0x3f));
+        } else {
+            out += (char)(0xf0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3f));
+            out += (char)(0x80 | ((cp >> 6) & 0x3f));
+            out += (char)(0x80 | (cp & 0x3f));
+        }
+    }
+
+    bool hex4(uint32_t &cp) {
+        if (end - p < 4) return false;
+        cp = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *p++;
+            cp <<= 4;
+            if (c >= '0' && c <= '9') cp |= c - '0';
+            else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    bool escape(std::string &out) {
+        if (p >= end) return false;
+        switch (*p++) {
+        case '"': out += '"'; return true;
+        case '\\': out += '\\'; return true;
+        case '/': out += '/'; return true;
+        case 'b': out += '\b'; return true;
+        case 'f': out += '\f'; return true;
+        case 'n': out += '\n'; return true;
+        case 'r': out += '\r'; return true;
+        case 't': out += '\t'; return true;
+        case 'u': {
+            uint32_t cp;
+            if (!hex4(cp)) return false;
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                uint32_t low;
+                if (!literal("\\u", 2) || !hex4(low) || low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                return false;
+            }
+            append_utf8(out, cp);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Called past the opening quote. Non-ASCII is left to json::parse(),
+    // which validates the UTF-8
+    bool string(std::string &out) {
+        for (;;) {
+            const char *run = p;
+            p = scan_string(p, end);
+            out.append(run, p - run);
+            if (p >= end || (*p != '"' && *p != '\\')) return false;
+            if (*p++ == '"') return true;
+            if (!escape(out)) return false;
+        }
+    }
+
+    /**
+     * Decodes a plain integer straight from its digits, if it is in the
+     * range of the integers of json::parse(); anything else leaves p as
+     * it is.
+     */
+    bool integer(uint64_t &value, bool &negative) {
+        const char *start = p;
+        bool overflow = false;
+
+        value = 0;
+        negative = p < end && *p == '-';
+        if (negative) p++;
+        if (p >= end || *p < '0' || *p > '9' ||
+                (*p == '0' && p + 1 < end && p[1] >= '0' && p[1] <= '9')) {
+            p = start;
+            return false;
+        }
+        // Eight digits at a time while the value cannot overflow
+        const char *digits = p;
+        uint64_t chunk;
+        while (end - p >= 8 && p - digits <= 11 && scan_digits8(p, chunk)) {
+            value = value * 100000000 + chunk;
+            p += 8;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            unsigned digit = *p++ - '0';
+            if (value > (UINT64_MAX - digit) / 10) overflow = true;
+            value = value * 10 + digit;
+        }
+        if (overflow || (p < end && (*p == '.' || *p == 'e' || *p == 'E')) ||
+                (negative && value > (uint64_t)INT64_MAX + 1)) {
+            p = start;
+            return false;
+        }
+        if (!value) negative = false;
+        return true;
+    }
+
+    /**
+     * Integers are decoded in place, into unsigned for non-negative values
+     * as json::parse() does. The rare fractions, exponents and integers
+     * out of range go through json::parse() itself, which, unlike strtod(),
+     * does not depend on the LC_NUMERIC of the process.
+     */
+    bool number(json &out) {
+        uint64_t value;
+        bool negative;
+        if (integer(value, negative)) {
+            if (negative) {
+                out = (int64_t)(0 - value);
+            } else {
+                out = value;
+            }
+            return true;
+        }
+
+        const char *start = p;
+        while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' ||
+                *p == '.' || *p == 'e' || *p == 'E')) {
+            p++;
+        }
+        if (p == start) return false;
+        out = json::parse(start, p, nullptr, false);
+        return !out.is_discarded();
+    }
+
+    bool object(json &out, int depth) {
+        std::string key;
+        out = json::object();
+        skip_ws();
+        if (p < end && *p == '}') {
+            p++;
+            return true;
+        }
+        for (;;) {
+            skip_ws();
+            if (p >= end || *p++ != '"') return false;
+            key.clear();
+            if (!string(key)) return false;
+            skip_ws();
+            if (p >= end || *p++ != ':') return false;
+            skip_ws();
+            if (!value(out[key], depth + 1)) return false;
+            skip_ws();
+            if (p >= end) return false;
+            if (*p == '}') {
+                p++;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    }
+
+    bool array(json &out, int depth) {
+        out = json::array();
+        json::array_t &elements = out.get_ref<json::array_t &>();
+        skip_ws();
+        if (p < end && *p == ']') {
+            p++;
+            return true;
+        }
+        for (;;) {
+            skip_ws();
+            elements.emplace_back();
+            if (!value(elements.back(), depth + 1)) return false;
+            skip_ws();
+            if (p >= end) return false;
+            if (*p == ']') {
+                p++;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    }
+
+    bool value(json &out, int depth) {
+        if (depth > PARSE_MAX_DEPTH || p >= end) return false;
+        switch (*p) {
+        case '{':
+            p++;
+            return object(out, depth);
+        case '[':
+            p++;
+            return array(out, depth);
+        case '"':
+            p++;
+            out = "";
+            return string(out.get_ref<std::string &>());
+        case 't':
+            out = true;
+            return literal("true", 4);
+        case 'f':
+            out = false;
+            return literal("false", 5);
+        case 'n':
+            out = nullptr;
+            return literal("null", 4);
+        default:
+            return number(out);
+        }
+    }
+
+    // Past an opening bracket or brace, whether its closing one follows
+    bool empty(char close) {
+        const char *start = p;
+        skip_ws();
+        if (p < end && *p == close) {
+            p++;
+            return true;
+        }
+        p = start;
+        return false;
+    }
+
+    /**
+     * Called past the opening bracket of an array. Returns 1 with the
+     * elements parsed into 'list' if they are all objects, 0, with p as it
+     * was, at the first element that is not, and -1 on errors.
+     */
+    int typed_array(std::vector<stats_object> &list, const stats_schema *schema, int depth) {
+        const char *start = p;
+        list.clear();
+        if (empty(']')) return 1;
+        for (;;) {
+            skip_ws();
+            if (p >= end || *p != '{') {
+                p = start;
+                list.clear();
+                return 0;
+            }
+            p++;
+            list.emplace_back(schema);
+            if (depth + 1 > PARSE_MAX_DEPTH || !typed_object(list.back(), depth + 1)) return -1;
+            skip_ws();
+            if (p >= end) return -1;
+            if (*p == ']') {
+                p++;
+                return 1;
+            }
+            if (*p++ != ',') return -1;
+        }
+    }
+
+    /**
+     * Called past the opening brace of an object, parsed into the slots of
+     * its schema. Keys come in the same order from one object to the next,
+     * so the field after the previous one is tried before the lookup
+     * table, and keys without escapes are matched where they are in the
+     * input. Values of an unexpected type go through value() into 'extra'.
+     */
+    bool typed_object(stats_object &obj, int depth) {
+        const stats_schema *schema = obj.schema;
+        uint32_t in_extra = 0;
+        int next = 0;
+        std::string escaped;
+        json generic;
+
+        if (empty('}')) return true;
+        for (;;) {
+            skip_ws();
+            if (p >= end || *p++ != '"') return false;
+            const char *key = p;
+            p = scan_string(p, end);
+            size_t len = p - key;
+            if (p < end && *p == '"') {
+                p++;
+            } else {
+                escaped.assign(key, len);
+                if (!string(escaped)) return false;
+                key = escaped.data();
+                len = escaped.size();
+            }
+            skip_ws();
+            if (p >= end || *p++ != ':') return false;
+            skip_ws();
+            if (p >= end) return false;
+
+            const stats_field *field = NULL;
+            if (next < schema->count && schema->fields[next].len == len &&
+                    !memcmp(schema->fields[next].name, key, len)) {
+                field = &schema->fields[next];
+            } else {
+                field = stats_find_field(schema, key, len);
+            }
+
+            bool typed = false;
+            if (field) {
+                int i = field - schema->fields;
+                next = i + 1;
+                switch (field->kind) {
+                case FIELD_INT: {
+                    bool negative;
+                    if ((typed = integer(obj.ints[i], negative))) {
+                        if (negative) {
+                            obj.ints[i] = 0 - obj.ints[i];
+                            obj.negative |= 1u << i;
+                        } else {
+                            obj.negative &= ~(1u << i);
+                        }
+                    }
+                    break;
+                }
+                case FIELD_STRING:
+                    if (*p == '"') {
+                        p++;
+                        obj.strings[field->slot].clear();
+                        if (!string(obj.strings[field->slot])) return false;
+                        typed = true;
+                    }
+                    break;
+                case FIELD_OBJECTS:
+                    if (*p == '[') {
+                        p++;
+                        int result = typed_array(obj.children[field->slot],
+                            &stats_schemas[field->child], depth + 1);
+                        if (result < 0) return false;
+                        if (!(typed = result > 0)) p--;
+                    }
+                    break;
+                case FIELD_EMPTY_ARRAY:
+                    if (*p == '[') {
+                        p++;
+                        if (!(typed = empty(']'))) p--;
+                    }
+                    break;
+                case FIELD_EMPTY_OBJECT:
+                    if (*p == '{') {
+                        p++;
+                        if (!(typed = empty('}'))) p--;
+                    }
+                    break;
+                }
+                if (typed) {
+                    obj.present |= 1u << i;
+                    if (in_extra & (1u << i)) {
+                        obj.extra.erase(field->name);
+                        in_extra &= ~(1u << i);
+                    }
+                }
+            }
+            if (!typed) {
+                if (!value(generic, depth + 1)) return false;
+                if (field) {
+                    obj.present &= ~(1u << (field - schema->fields));
+                    in_extra |= 1u << (field - schema->fields);
+                }
+                if (!obj.extra.is_object()) {
+                    obj.extra = json::object();
+                }
+                obj.extra[std::string(key, len)] = std::move(generic);
+            }
+
+            skip_ws();
+            if (p >= end) return false;
+            if (*p == '}') {
+                p++;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    }
+
+    /**
+     * Called past the opening brace of the document: its "workers" are
+     * parsed typed, if they are an array of objects, and everything else
+     * as json.
+     */
+    bool root(stats_snapshot &snap) {
+        std::string key;
+        snap.doc = json::object();
+        if (empty('}')) return true;
+        for (;;) {
+            skip_ws();
+            if (p >= end || *p++ != '"') return false;
+            key.clear();
+            if (!string(key)) return false;
+            skip_ws();
+            if (p >= end || *p++ != ':') return false;
+            skip_ws();
+
+            int result = 0;
+            if (key == "workers" && p < end && *p == '[') {
+                p++;
+                result = typed_array(snap.workers, &stats_schemas[SCHEMA_WORKER], 1);
+                if (result < 0) return false;
+                if (!result) p--;
+            }
+            if (result) {
+                snap.typed = true;
+                snap.doc.erase("workers");
+            } else {
+                if (!value(snap.doc[key], 1)) return false;
+                if (key == "workers") {
+                    snap.typed = false;
+                    snap.workers.clear();
+                }
+            }
+
+            skip_ws();
+            if (p >= end) return false;
+            if (*p == '}') {
+                p++;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    }
+};
+
+/**
+ * Parses the stats JSON produced by uWSGI into a snapshot of the document
+ * json::parse() would return: its workers straight into typed objects
+ * (see stats.h), and the rest of it as json. Falls back to json::parse()
+ * for any input the specialized parser does not accept, so errors are
+ * reported (thrown) exactly as before.
+ */
+stats_snapshot parse_stats(const char *data, size_t len) {
+    stats_snapshot snap;
+    stats_parser parser = {data, data + len};
+
+    parser.skip_ws();
+    if (parser.p < parser.end && *parser.p == '{') {
+        parser.p++;
+        if (parser.root(snap)) {
+            parser.skip_ws();
+            if (parser.p == parser.end) {
+                return snap;
+            }
+        }
+    }
+    return stats_from_json(json::parse(data, data + len));
+}
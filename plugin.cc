@@ -1,16 +1,44 @@
 #include <uwsgi.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
 #include <stdlib.h>
 #include <cstdint>
 #include <mongoc/mongoc.h>
 #include <bson/bson.h>
 #include "json.hpp"
-
-using json = nlohmann::json;
+#include "fnv.h"
+#include "stats.h"
 
 extern struct uwsgi_server uwsgi;
 
-void transform_metrics(json &doc);
+void transform_metrics(stats_snapshot &snap);
+bool compile_metric_rules(struct uwsgi_string_list *specs);
+void counter_snapshot(const stats_snapshot &snap);
+json counter_deltas();
+void counter_deltas_commit();
+bson_t *stats_to_bson(const stats_snapshot &snap, int threads, bson_error_t *error);
+stats_snapshot parse_stats(const char *data, size_t len);
+void sparse_workers(stats_snapshot &snap, int top_k);
+json worker_summary(const stats_snapshot &snap);
+void latency_init();
+json latency_histogram();
+bool routes_init(struct uwsgi_string_list *specs, int max);
+json routes_drain();
+void slow_init(int threshold_ms, int size);
+json slow_drain(uint64_t *seen);
+
+// Compressors missing from older libmongoc releases are unsupported
+#ifndef MONGOC_ENABLE_COMPRESSION_SNAPPY
+#define MONGOC_ENABLE_COMPRESSION_SNAPPY 0
+#endif
+#ifndef MONGOC_ENABLE_COMPRESSION_ZLIB
+#define MONGOC_ENABLE_COMPRESSION_ZLIB 0
+#endif
+#ifndef MONGOC_ENABLE_COMPRESSION_ZSTD
+#define MONGOC_ENABLE_COMPRESSION_ZSTD 0
+#endif
 
 #define LG0(err)      uwsgi_log("[stats-pusher-mongodb] " err "\n")
 #define LOG(err, ...) uwsgi_log("[stats-pusher-mongodb] " err "\n", __VA_ARGS__)
@@ -18,42 +46,297 @@ void transform_metrics(json &doc);
 
 
 struct uwsgi_mongo_keyval {
-    json::json_pointer key;
+    stats_path key;
     std::string val_str;
     long long val_int;
     bool is_int;
 };
 
+/**
+ * A mongodb deployment stats can be pushed to. Targets are tried in the
+ * order they were configured (mongo-stats first, then each
+ * mongo-stats-failover); each one has its own pool, long-lived client and
+ * collection handles, guarded by 'lock', and the health measured by the
+ * probe thread, by pushes and by event writes. Health is written with the
+ * lock held, but read without it (atomically) so that choosing a target
+ * never waits for a push or a ping in progress.
+ */
+struct uwsgi_mongo_target {
+    int priority;
+    char *address;
+    mongoc_uri_t *uri;
+    mongoc_client_pool_t *pool;
+    mongoc_client_t *client;
+    pthread_mutex_t lock;
+    time_t used;
+    char partition[256];
+    mongoc_collection_t *partition_coll;
+    char provisioned[256];
+    mongoc_collection_t *latest_handle;
+    mongoc_collection_t *counters_handle;
+    mongoc_collection_t *slow_handle;
+    mongoc_collection_t *events_handle;
+    int failures;
+    double rtt_ms;
+    double error_rate;
+    struct uwsgi_mongo_target *next;
+};
+
+enum uwsgi_mongo_id_strategy {
+    STATS_PUSHER_MONGODB_ID_OID,
+    STATS_PUSHER_MONGODB_ID_COMPOSITE,
+    STATS_PUSHER_MONGODB_ID_HASHED,
+    STATS_PUSHER_MONGODB_ID_BUCKETED,
+};
+
+/**
+ * Configuration reread from mongo-stats-reload-file, handed from the probe
+ * thread to the pusher. NULL lists keep the startup ones.
+ */
+struct uwsgi_mongo_reload {
+    int freq;
+    char *db_coll;
+    struct uwsgi_string_list *custom_kvals_str;
+    struct uwsgi_string_list *custom_kvals_int;
+};
+
 struct uwsgi_mongo_stats {
     char *address;
+    struct uwsgi_string_list *failover;
+    struct uwsgi_mongo_target *targets;
+    struct uwsgi_mongo_target *current;
+    int probe_freq;
     int freq;
+    bool spread;
+    int phase;
+    char *bucket_field;
     char *db_coll;
     char *db;
     char *coll;
+    bool partitioned;
+    int retention;
+    struct uwsgi_string_list *index_specs;
+    bson_t *indexes;
+    char *date_field;
+    int ttl;
+    uint64_t capped;
+    char *latest_db_coll;
+    char *latest_db;
+    char *latest_coll;
+    struct uwsgi_string_list *latest_keys;
+    struct uwsgi_string_list *metric_rules;
+    char *counters_db_coll;
+    char *counters_db;
+    char *counters_coll;
+    int slow_ms;
+    int slow_samples;
+    char *slow_db_coll;
+    bool slow_default_ns;
+    char *slow_db;
+    char *slow_coll;
+    uint64_t slow_dropped;
+    char *events_db_coll;
+    char *events_db;
+    char *events_coll;
+    pthread_mutex_t events_lock;
+    pthread_cond_t events_cond;
+    pthread_t events_thread;
+    bool events_started;
+    bool events_stop;
+    uint64_t events_dropped;
+    int counters_bucket;
+    char *id;
+    enum uwsgi_mongo_id_strategy id_strategy;
+    int id_buckets;
+    bson_t *write_opts;
+    bson_t *upsert_opts;
+    char *w;
+    bool journal;
+    int wtimeout;
+    bool bypass_validation;
     bool verbose;
-    mongoc_uri_t *uri;
-    mongoc_client_pool_t *pool;
+    char *compressors;
+    int max_pool_size;
+    int server_selection_timeout;
+    int socket_timeout;
+    int connect_timeout;
+    int keepalive;
+    int convert_threads;
+    int summary;
+    int latency;
+    int routes;
+    struct uwsgi_string_list *route_rules;
+    int routes_max;
+    int sparse;
+    int sparse_top;
+    int deadline_ms;
+    int retries;
+    int retry_backoff_ms;
+    uint64_t deadline_misses;
+    uint64_t fallbacks;
+    char *spool;
+    int spool_fd;
     struct uwsgi_string_list *custom_kvals_str;
     struct uwsgi_string_list *custom_kvals_int;
+    char *reload_file;
+    time_t reload_mtime;
+    struct uwsgi_mongo_reload startup;
+    struct uwsgi_mongo_reload *reload;
+    pthread_mutex_t reload_lock;
+    pthread_t probe_thread;
+    bool probe_started;
+    bool probe_stop;
+    pthread_mutex_t probe_lock;
+    pthread_cond_t probe_cond;
     struct uwsgi_stats_pusher *pusher;
+    struct uwsgi_stats_pusher_instance *uspi;
 } u_mongo;
 
 static struct uwsgi_option stats_pusher_mongodb_options[] = {
     {(char *)"mongo-stats", required_argument, 0,
         (char *)"server where stats are pushed",
         uwsgi_opt_set_str, &u_mongo.address, 0},
+    {(char *)"mongo-stats-failover", required_argument, 0,
+        (char *)"server where stats are pushed while the previous ones are down (in priority order)",
+        uwsgi_opt_add_string_list, &u_mongo.failover, 0},
+    {(char *)"mongo-stats-probe-freq", required_argument, 0,
+        (char *)"set the health probe frequency of failover targets in seconds (default 5)",
+        uwsgi_opt_set_int, &u_mongo.probe_freq, 0},
     {(char *)"mongo-stats-collection", required_argument, 0,
-        (char *)"collection where stats are pushed (default uwsgi.stats)",
+        (char *)"collection where stats are pushed, may contain strftime() UTC specifiers (default uwsgi.stats)",
         uwsgi_opt_set_str, &u_mongo.db_coll, 0},
+    {(char *)"mongo-stats-id", required_argument, 0,
+        (char *)"set how stats document ids are built: oid, composite, hashed or bucketed (default oid)",
+        uwsgi_opt_set_str, &u_mongo.id, 0},
+    {(char *)"mongo-stats-id-buckets", required_argument, 0,
+        (char *)"set the number of buckets of bucketed ids (default 16)",
+        uwsgi_opt_set_int, &u_mongo.id_buckets, 0},
+    {(char *)"mongo-stats-retention", required_argument, 0,
+        (char *)"drop time-partitioned stats collections older than this many seconds",
+        uwsgi_opt_set_int, &u_mongo.retention, 0},
     {(char *)"mongo-stats-freq", required_argument, 0,
         (char *)"set mongo stats push frequency in seconds (default 60)",
         uwsgi_opt_set_int, &u_mongo.freq, 0},
+    {(char *)"mongo-stats-spread", no_argument, 0,
+        (char *)"spread pushes of different instances over the push interval",
+        uwsgi_opt_true, &u_mongo.spread, 0},
+    {(char *)"mongo-stats-bucket-field", required_argument, 0,
+        (char *)"add the start of the push interval as a BSON date field with this name (default bucket with mongo-stats-spread)",
+        uwsgi_opt_set_str, &u_mongo.bucket_field, 0},
     {(char *)"mongo-stats-kv", required_argument, 0,
         (char *)"add a custom key/value to the stats json",
         uwsgi_opt_add_string_list, &u_mongo.custom_kvals_str, 0},
     {(char *)"mongo-stats-kv-int", required_argument, 0,
         (char *)"add a custom int key/value to the stats json",
         uwsgi_opt_add_string_list, &u_mongo.custom_kvals_int, 0},
+    {(char *)"mongo-stats-index", required_argument, 0,
+        (char *)"ensure an index on the stats collection, e.g. procname:1,date:-1",
+        uwsgi_opt_add_string_list, &u_mongo.index_specs, 0},
+    {(char *)"mongo-stats-date-field", required_argument, 0,
+        (char *)"add the push time as a BSON date field with this name",
+        uwsgi_opt_set_str, &u_mongo.date_field, 0},
+    {(char *)"mongo-stats-ttl", required_argument, 0,
+        (char *)"expire stats documents after this many seconds with a TTL index on the date field (default field: date)",
+        uwsgi_opt_set_int, &u_mongo.ttl, 0},
+    {(char *)"mongo-stats-capped", required_argument, 0,
+        (char *)"create the stats collection as a capped collection of this size in bytes",
+        uwsgi_opt_set_64bit, &u_mongo.capped, 0},
+    {(char *)"mongo-stats-latest-collection", required_argument, 0,
+        (char *)"also upsert the latest stats of each instance into this collection",
+        uwsgi_opt_set_str, &u_mongo.latest_db_coll, 0},
+    {(char *)"mongo-stats-latest-key", required_argument, 0,
+        (char *)"json pointer identifying an instance in the latest and counters collections (default /procname)",
+        uwsgi_opt_add_string_list, &u_mongo.latest_keys, 0},
+    {(char *)"mongo-stats-metric-rule", required_argument, 0,
+        (char *)"rewrite metric keys with a prefix, drop, rename, plural or offset rule (replaces the default plural * and offset worker -1)",
+        uwsgi_opt_add_string_list, &u_mongo.metric_rules, 0},
+    {(char *)"mongo-stats-counters-collection", required_argument, 0,
+        (char *)"accumulate counter deltas of each instance into bucket documents of this collection",
+        uwsgi_opt_set_str, &u_mongo.counters_db_coll, 0},
+    {(char *)"mongo-stats-counters-bucket", required_argument, 0,
+        (char *)"set the counters bucket size in seconds (default 3600)",
+        uwsgi_opt_set_int, &u_mongo.counters_bucket, 0},
+    {(char *)"mongo-stats-w", required_argument, 0,
+        (char *)"set the write concern w option, a number or majority (0 disables acknowledgement)",
+        uwsgi_opt_set_str, &u_mongo.w, 0},
+    {(char *)"mongo-stats-journal", no_argument, 0,
+        (char *)"require writes to be acknowledged after being journaled",
+        uwsgi_opt_true, &u_mongo.journal, 0},
+    {(char *)"mongo-stats-wtimeout", required_argument, 0,
+        (char *)"set the write concern timeout in milliseconds",
+        uwsgi_opt_set_int, &u_mongo.wtimeout, 0},
+    {(char *)"mongo-stats-bypass-validation", no_argument, 0,
+        (char *)"bypass document validation of the stats collections",
+        uwsgi_opt_true, &u_mongo.bypass_validation, 0},
+    {(char *)"mongo-stats-compressors", required_argument, 0,
+        (char *)"comma-separated wire compressors to negotiate (snappy, zlib, zstd)",
+        uwsgi_opt_set_str, &u_mongo.compressors, 0},
+    {(char *)"mongo-stats-max-pool-size", required_argument, 0,
+        (char *)"set the maximum number of pooled connections",
+        uwsgi_opt_set_int, &u_mongo.max_pool_size, 0},
+    {(char *)"mongo-stats-server-selection-timeout", required_argument, 0,
+        (char *)"set the server selection timeout in milliseconds",
+        uwsgi_opt_set_int, &u_mongo.server_selection_timeout, 0},
+    {(char *)"mongo-stats-socket-timeout", required_argument, 0,
+        (char *)"set the socket timeout in milliseconds",
+        uwsgi_opt_set_int, &u_mongo.socket_timeout, 0},
+    {(char *)"mongo-stats-connect-timeout", required_argument, 0,
+        (char *)"set the connect timeout in milliseconds",
+        uwsgi_opt_set_int, &u_mongo.connect_timeout, 0},
+    {(char *)"mongo-stats-keepalive", required_argument, 0,
+        (char *)"ping mongodb when the connection has been idle for this many seconds",
+        uwsgi_opt_set_int, &u_mongo.keepalive, 0},
+    {(char *)"mongo-stats-latency", no_argument, 0,
+        (char *)"record request durations into per-worker histograms and push their percentiles",
+        uwsgi_opt_true, &u_mongo.latency, 0},
+    {(char *)"mongo-stats-routes", no_argument, 0,
+        (char *)"count requests, errors and latency per route",
+        uwsgi_opt_true, &u_mongo.routes, 0},
+    {(char *)"mongo-stats-route", required_argument, 0,
+        (char *)"count requests whose path starts with a prefix, or matches a ~regex, under a route (\"<prefix> <route>\")",
+        uwsgi_opt_add_string_list, &u_mongo.route_rules, 0},
+    {(char *)"mongo-stats-routes-max", required_argument, 0,
+        (char *)"set the maximum number of distinct routes, past which requests count as other (default 256)",
+        uwsgi_opt_set_int, &u_mongo.routes_max, 0},
+    {(char *)"mongo-stats-slow-ms", required_argument, 0,
+        (char *)"capture a sample of the requests slower than this many milliseconds",
+        uwsgi_opt_set_int, &u_mongo.slow_ms, 0},
+    {(char *)"mongo-stats-slow-samples", required_argument, 0,
+        (char *)"set the number of slow requests sampled per worker and push (default 32)",
+        uwsgi_opt_set_int, &u_mongo.slow_samples, 0},
+    {(char *)"mongo-stats-slow-collection", required_argument, 0,
+        (char *)"insert the slow request samples into this collection (default <stats db>.slow_requests)",
+        uwsgi_opt_set_str, &u_mongo.slow_db_coll, 0},
+    {(char *)"mongo-stats-events-collection", required_argument, 0,
+        (char *)"insert an event with the worker state into this collection on harakiri, exit and respawn",
+        uwsgi_opt_set_str, &u_mongo.events_db_coll, 0},
+    {(char *)"mongo-stats-summary", no_argument, 0,
+        (char *)"add a summary of avg_rt, memory, requests and busy cores across workers",
+        uwsgi_opt_true, &u_mongo.summary, 0},
+    {(char *)"mongo-stats-sparse", no_argument, 0,
+        (char *)"leave zero counters and idle cores out of the worker stats",
+        uwsgi_opt_true, &u_mongo.sparse, 0},
+    {(char *)"mongo-stats-sparse-top", required_argument, 0,
+        (char *)"keep this many of the busiest workers in full detail and summarize the others",
+        uwsgi_opt_set_int, &u_mongo.sparse_top, 0},
+    {(char *)"mongo-stats-convert-threads", required_argument, 0,
+        (char *)"convert the workers of large instances to BSON in parallel with this many threads",
+        uwsgi_opt_set_int, &u_mongo.convert_threads, 0},
+    {(char *)"mongo-stats-deadline-ms", required_argument, 0,
+        (char *)"bound the time spent on a push, falling back to the spool (or dropping the document) when exceeded",
+        uwsgi_opt_set_int, &u_mongo.deadline_ms, 0},
+    {(char *)"mongo-stats-retries", required_argument, 0,
+        (char *)"retry inserts failing with a transient error this many times",
+        uwsgi_opt_set_int, &u_mongo.retries, 0},
+    {(char *)"mongo-stats-retry-backoff-ms", required_argument, 0,
+        (char *)"set the delay before the first retry, doubled on each one (default 100)",
+        uwsgi_opt_set_int, &u_mongo.retry_backoff_ms, 0},
+    {(char *)"mongo-stats-spool", required_argument, 0,
+        (char *)"append documents that could not be inserted to this file as extended json lines",
+        uwsgi_opt_set_str, &u_mongo.spool, 0},
+    {(char *)"mongo-stats-reload-file", required_argument, 0,
+        (char *)"reload freq, collection and keyvals from this file whenever it changes",
+        uwsgi_opt_set_str, &u_mongo.reload_file, 0},
     {(char *)"mongo-stats-verbose", no_argument, 0,
         (char *)"enable verbose log messages",
         uwsgi_opt_true, &u_mongo.verbose, 0},
@@ -65,12 +348,70 @@ static int stats_pusher_mongodb_init(void) {
     return 1;
 }
 
+/**
+ * Destroys the cached collection handles of a target. Must be called with
+ * the target lock held.
+ */
+static void stats_pusher_mongodb_drop_handles(struct uwsgi_mongo_target *target) {
+    mongoc_collection_t **handles[] = {&target->partition_coll, &target->latest_handle,
+        &target->counters_handle, &target->slow_handle, &target->events_handle};
+    for (mongoc_collection_t **handle : handles) {
+        if (*handle) {
+            mongoc_collection_destroy(*handle);
+            *handle = NULL;
+        }
+    }
+    target->partition[0] = 0;
+    target->provisioned[0] = 0;
+}
+
 static void stats_pusher_mongodb_atexit() {
-    if (u_mongo.pool) {
-        mongoc_client_pool_destroy(u_mongo.pool);
+    // The pool and its background threads only exist in the master, workers
+    // just inherited a copy of them at fork
+    if (uwsgi.mywid > 0) {
+        return;
     }
-    if (u_mongo.uri) {
-        mongoc_uri_destroy(u_mongo.uri);
+    // The probe thread uses the clients of the targets: stop it first
+    if (u_mongo.probe_started) {
+        pthread_mutex_lock(&u_mongo.probe_lock);
+        u_mongo.probe_stop = true;
+        pthread_cond_broadcast(&u_mongo.probe_cond);
+        pthread_mutex_unlock(&u_mongo.probe_lock);
+        pthread_join(u_mongo.probe_thread, NULL);
+        u_mongo.probe_started = false;
+    }
+    // So does the events thread, which writes what is still queued first
+    if (u_mongo.events_started) {
+        pthread_mutex_lock(&u_mongo.events_lock);
+        u_mongo.events_stop = true;
+        pthread_cond_broadcast(&u_mongo.events_cond);
+        pthread_mutex_unlock(&u_mongo.events_lock);
+        pthread_join(u_mongo.events_thread, NULL);
+        u_mongo.events_started = false;
+    }
+    struct uwsgi_mongo_target *target;
+    for (target = u_mongo.targets; target; target = target->next) {
+        pthread_mutex_lock(&target->lock);
+        if (target->client) {
+            stats_pusher_mongodb_drop_handles(target);
+            mongoc_client_pool_push(target->pool, target->client);
+            target->client = NULL;
+        }
+        if (target->pool) {
+            mongoc_client_pool_destroy(target->pool);
+        }
+        mongoc_uri_destroy(target->uri);
+        target->pool = NULL;
+        pthread_mutex_unlock(&target->lock);
+    }
+    if (u_mongo.indexes) {
+        bson_destroy(u_mongo.indexes);
+    }
+    if (u_mongo.upsert_opts) {
+        bson_destroy(u_mongo.upsert_opts);
+    }
+    if (u_mongo.write_opts) {
+        bson_destroy(u_mongo.write_opts);
     }
     mongoc_cleanup();
 }
@@ -94,7 +435,7 @@ static void stats_pusher_mongodb_register_keyval(uwsgi_string_list *usl, bool is
     val = str.substr(pos + 1, std::string::npos);
 
     try {
-        kv->key = json::json_pointer(key);
+        kv->key = stats_path_of(key);
     } catch (json::exception &exc) {
         LOG("invalid keyval json pointer in '%s': %s",
             kv->val_str.c_str(), exc.what());
@@ -119,62 +460,1347 @@ static void stats_pusher_mongodb_register_keyval(uwsgi_string_list *usl, bool is
     DBG("added custom keyval: %s=%s", key.c_str(), val.c_str());
 }
 
-static void stats_pusher_mongodb_set_doc_val(json &doc, uwsgi_string_list *usl) {
+static void stats_pusher_mongodb_set_doc_val(stats_snapshot &stats, uwsgi_string_list *usl) {
     if (usl->custom_ptr == NULL) {
         return;
     }
     struct uwsgi_mongo_keyval *kv = (struct uwsgi_mongo_keyval *)usl->custom_ptr;
     try {
         if (kv->is_int) {
-            doc[kv->key] = kv->val_int;
+            stats_set(stats, kv->key, kv->val_int);
         } else {
-            doc[kv->key] = kv->val_str;
+            stats_set(stats, kv->key, kv->val_str);
         }
     } catch (json::exception &exc) {
         LOG("error setting custom keyval: %s: %s",
-            kv->key.to_string().c_str(), exc.what());
+            kv->key.ptr.to_string().c_str(), exc.what());
     }
 }
 
-static void stats_pusher_mongodb_update_doc(json &doc) {
+static void stats_pusher_mongodb_update_doc(stats_snapshot &stats) {
     struct uwsgi_string_list *usl;
     uwsgi_foreach(usl, u_mongo.custom_kvals_str) {
-        stats_pusher_mongodb_set_doc_val(doc, usl);
+        stats_pusher_mongodb_set_doc_val(stats, usl);
     }
     uwsgi_foreach(usl, u_mongo.custom_kvals_int) {
-        stats_pusher_mongodb_set_doc_val(doc, usl);
+        stats_pusher_mongodb_set_doc_val(stats, usl);
+    }
+}
+
+static void stats_pusher_mongodb_register_latest_key(uwsgi_string_list *usl) {
+    try {
+        usl->custom_ptr = (void *)new stats_path(stats_path_of(usl->value));
+    } catch (json::exception &exc) {
+        LOG("invalid latest key json pointer '%s': %s", usl->value, exc.what());
+        exit(1);
+    }
+}
+
+/**
+ * Builds the filter matching the documents of this instance in the latest
+ * and counters collections,
+ * e.g. {"procname": "uwsgi master"} for the default /procname key. Keys
+ * missing from the document match as null.
+ */
+static bson_t *stats_pusher_mongodb_latest_filter(const stats_snapshot &stats,
+        bson_error_t *error) {
+    struct uwsgi_string_list *usl;
+    json filter = json::object();
+
+    uwsgi_foreach(usl, u_mongo.latest_keys) {
+        stats_path *path = (stats_path *)usl->custom_ptr;
+        std::string field = path->ptr.to_string().substr(1);
+        std::replace(field.begin(), field.end(), '/', '.');
+        try {
+            filter[field] = stats_at(stats, *path);
+        } catch (json::exception &exc) {
+            filter[field] = nullptr;
+        }
+    }
+
+    std::string str = filter.dump();
+    return bson_new_from_json((const uint8_t *)str.c_str(), -1, error);
+}
+
+static void stats_pusher_mongodb_split_ns(char *db_coll, char **db, char **coll) {
+    *db = uwsgi_str(db_coll);
+    *coll = strchr(*db, '.');
+    if (!*coll) {
+        LOG("invalid mongo collection (%s), must be in the form db.collection",
+            db_coll);
+        exit(1);
+    }
+    (*coll)[0] = 0;
+    (*coll)++;
+}
+
+static uint32_t stats_pusher_mongodb_hash(const std::string &str) {
+    return fnv1a_32(str.data(), str.size());
+}
+
+/**
+ * Names this instance as "procname/hostname", or the hostname alone when
+ * no procname is set: a fleet usually shares its procname, so it cannot
+ * tell instances apart on its own.
+ */
+static std::string stats_pusher_mongodb_instance_name() {
+    const char *procname = uwsgi.procname_master ? uwsgi.procname_master : uwsgi.procname;
+    if (!procname) return std::string(uwsgi.hostname);
+    return std::string(procname) + "/" + uwsgi.hostname;
+}
+
+/**
+ * Names the instance a stats document comes from, as
+ * stats_pusher_mongodb_instance_name() does but with the procname of the
+ * document, which a custom key may have replaced.
+ */
+static std::string stats_pusher_mongodb_instance(const json &doc) {
+    auto procname = doc.find("procname");
+    if (procname != doc.end() && procname->is_string()) {
+        return procname->get<std::string>() + "/" + uwsgi.hostname;
+    }
+    return std::string(uwsgi.hostname);
+}
+
+/**
+ * Appends the snapshot _id to a history document, according to
+ * mongo-stats-id:
+ *
+ *     oid:       ObjectId, monotonically increasing across the fleet
+ *     composite: {i: instance, t: capture time}
+ *     hashed:    {h: hash(instance), i: instance, t: capture time}
+ *     bucketed:  {b: capture second % mongo-stats-id-buckets,
+ *                 t: capture time, i: instance}
+ *
+ * The instance is "procname/hostname", or the hostname when no procname
+ * is set, so that the instances of a fleet sharing a procname get ids of
+ * their own. With a sharded stats collection, composite ids spread
+ * inserts by instance, hashed ids also spread instances with similar
+ * names, and both keep the documents of one instance contiguous for range
+ * scans on {i, t}.
+ * Bucketed ids rotate inserts over a fixed number of time buckets, each
+ * ordered by time, for fleet-wide time range queries; with
+ * mongo-stats-spread, instances push in different seconds, hence to
+ * different buckets.
+ */
+static void stats_pusher_mongodb_append_id(bson_t *bson, const bson_oid_t *oid,
+                                           const std::string &instance,
+                                           int64_t ts_ms) {
+    bson_t id;
+
+    if (u_mongo.id_strategy == STATS_PUSHER_MONGODB_ID_OID) {
+        BSON_APPEND_OID(bson, "_id", oid);
+        return;
+    }
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, "_id", &id);
+    switch (u_mongo.id_strategy) {
+    case STATS_PUSHER_MONGODB_ID_HASHED:
+        BSON_APPEND_INT32(&id, "h", (int32_t)stats_pusher_mongodb_hash(instance));
+        BSON_APPEND_UTF8(&id, "i", instance.c_str());
+        BSON_APPEND_DATE_TIME(&id, "t", ts_ms);
+        break;
+    case STATS_PUSHER_MONGODB_ID_BUCKETED:
+        BSON_APPEND_INT32(&id, "b", (int32_t)(ts_ms / 1000 % u_mongo.id_buckets));
+        BSON_APPEND_DATE_TIME(&id, "t", ts_ms);
+        BSON_APPEND_UTF8(&id, "i", instance.c_str());
+        break;
+    default:
+        BSON_APPEND_UTF8(&id, "i", instance.c_str());
+        BSON_APPEND_DATE_TIME(&id, "t", ts_ms);
+        break;
+    }
+    bson_append_document_end(bson, &id);
+}
+
+static void stats_pusher_mongodb_parse_id_strategy() {
+    if (!u_mongo.id || !strcmp(u_mongo.id, "oid")) {
+        u_mongo.id_strategy = STATS_PUSHER_MONGODB_ID_OID;
+    } else if (!strcmp(u_mongo.id, "composite")) {
+        u_mongo.id_strategy = STATS_PUSHER_MONGODB_ID_COMPOSITE;
+    } else if (!strcmp(u_mongo.id, "hashed")) {
+        u_mongo.id_strategy = STATS_PUSHER_MONGODB_ID_HASHED;
+    } else if (!strcmp(u_mongo.id, "bucketed")) {
+        u_mongo.id_strategy = STATS_PUSHER_MONGODB_ID_BUCKETED;
+    } else {
+        LOG("invalid mongo-stats-id (%s), must be oid, composite, hashed or bucketed",
+            u_mongo.id);
+        exit(1);
+    }
+    if (!u_mongo.id_buckets) u_mongo.id_buckets = 16;
+    if (u_mongo.id_buckets < 0) {
+        LOG("invalid mongo-stats-id-buckets (%d)", u_mongo.id_buckets);
+        exit(1);
+    }
+}
+
+/**
+ * Appends an index to the indexes ensured on the stats collection. The
+ * spec is a comma-separated list of field:type pairs, where type is 1, -1
+ * or an index type such as hashed. The index is named the way mongod
+ * names it by default (e.g. procname_1_date_-1), so that an index created
+ * by hand is recognized as the same one. Returns that name.
+ */
+static std::string stats_pusher_mongodb_add_index(const char *spec, int ttl) {
+    bson_t keys = BSON_INITIALIZER;
+    bson_t index;
+    std::string name;
+    std::string str(spec);
+    std::string::size_type last = 0, pos;
+
+    do {
+        pos = str.find(',', last);
+        std::string part = str.substr(last, pos == std::string::npos ?
+            std::string::npos : pos - last);
+        last = pos + 1;
+
+        std::string::size_type colon = part.find(':');
+        if (part.empty() || colon == 0 || colon == std::string::npos) {
+            LOG("invalid index spec '%s', must be in the form field:type[,...]", spec);
+            exit(1);
+        }
+        std::string field = part.substr(0, colon);
+        std::string type = part.substr(colon + 1);
+        if (type == "1" || type == "-1") {
+            BSON_APPEND_INT32(&keys, field.c_str(), type == "1" ? 1 : -1);
+        } else {
+            BSON_APPEND_UTF8(&keys, field.c_str(), type.c_str());
+        }
+        name += (name.empty() ? "" : "_") + field + "_" + type;
+    } while (pos != std::string::npos);
+
+    char buf[16];
+    const char *key;
+    bson_uint32_to_string(bson_count_keys(u_mongo.indexes), &key, buf, sizeof(buf));
+    bson_append_document_begin(u_mongo.indexes, key, -1, &index);
+    BSON_APPEND_DOCUMENT(&index, "key", &keys);
+    BSON_APPEND_UTF8(&index, "name", name.c_str());
+    if (ttl) {
+        BSON_APPEND_INT32(&index, "expireAfterSeconds", ttl);
+    }
+    bson_append_document_end(u_mongo.indexes, &index);
+    bson_destroy(&keys);
+    return name;
+}
+
+static bool stats_pusher_mongodb_transient_error(const bson_error_t *error,
+                                                 const bson_t *reply);
+
+/**
+ * Creates the capped collection and ensures the indexes configured for the
+ * stats collection 'name'. Both operations are idempotent, so this simply
+ * runs again for every new partition, and on the next push if mongod
+ * could not be reached. Returns false only in that case: a collection or
+ * index the server rejects (e.g. an IndexOptionsConflict with an existing
+ * index) would be rejected again, so it is logged once and not retried.
+ */
+static bool stats_pusher_mongodb_provision(struct uwsgi_mongo_target *target,
+                                           const char *name) {
+    bson_error_t error;
+    bson_t reply;
+    bool ok = true;
+    bool transient = false;
+    mongoc_database_t *db = mongoc_client_get_database(target->client, u_mongo.db);
+
+    if (u_mongo.capped) {
+        bson_t opts = BSON_INITIALIZER;
+        BSON_APPEND_BOOL(&opts, "capped", true);
+        BSON_APPEND_INT64(&opts, "size", (int64_t)u_mongo.capped);
+        mongoc_collection_t *coll = mongoc_database_create_collection(db,
+            name, &opts, &error);
+        if (coll) {
+            mongoc_collection_destroy(coll);
+        } else if (error.code != 48) {
+            // 48: NamespaceExists
+            LOG("MONGO ERROR(%s/%s.%s): %s", target->address, u_mongo.db,
+                name, error.message);
+            ok = false;
+            transient = stats_pusher_mongodb_transient_error(&error, NULL);
+        }
+        bson_destroy(&opts);
+    }
+
+    if (ok && u_mongo.indexes) {
+        bson_t cmd = BSON_INITIALIZER;
+        BSON_APPEND_UTF8(&cmd, "createIndexes", name);
+        BSON_APPEND_ARRAY(&cmd, "indexes", u_mongo.indexes);
+        if (!mongoc_database_write_command_with_opts(db, &cmd, NULL, &reply, &error)) {
+            LOG("MONGO ERROR(%s/%s.%s): %s", target->address, u_mongo.db,
+                name, error.message);
+            ok = false;
+            transient = stats_pusher_mongodb_transient_error(&error, &reply);
+        }
+        bson_destroy(&reply);
+        bson_destroy(&cmd);
+    }
+
+    mongoc_database_destroy(db);
+    if (ok) {
+        DBG("provisioned stats collection %s.%s", u_mongo.db, name);
+    } else if (!transient) {
+        LOG("not retrying to provision %s.%s on %s", u_mongo.db, name, target->address);
+    }
+    return ok || !transient;
+}
+
+/**
+ * Returns the time span covered by one partition of a collection name
+ * template, based on the finest strftime() specifier it contains.
+ */
+static time_t stats_pusher_mongodb_partition_span(const char *tmpl) {
+    if (strstr(tmpl, "%M")) return 60;
+    if (strstr(tmpl, "%H")) return 3600;
+    if (strstr(tmpl, "%d") || strstr(tmpl, "%j")) return 86400;
+    if (strstr(tmpl, "%m")) return 31 * 86400;
+    return 366 * 86400;
+}
+
+/**
+ * Drops the partitions of the collection name template that ended more
+ * than mongo-stats-retention seconds ago. Collection names are matched
+ * against the template with strptime(), so unrelated collections in the
+ * database are never touched.
+ */
+static void stats_pusher_mongodb_drop_expired(struct uwsgi_mongo_target *target,
+                                              time_t now) {
+    bson_error_t error;
+    mongoc_database_t *db = mongoc_client_get_database(target->client, u_mongo.db);
+    char **names = mongoc_database_get_collection_names_with_opts(db, NULL, &error);
+
+    if (!names) {
+        LOG("MONGO ERROR(%s/%s): %s", target->address, u_mongo.db, error.message);
+        mongoc_database_destroy(db);
+        return;
+    }
+
+    time_t span = stats_pusher_mongodb_partition_span(u_mongo.coll);
+    for (char **name = names; *name; name++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_mday = 1;
+        char *end = strptime(*name, u_mongo.coll, &tm);
+        if (!end || *end || !strcmp(*name, target->partition)) continue;
+        if (timegm(&tm) + span > now - u_mongo.retention) continue;
+
+        mongoc_collection_t *coll = mongoc_client_get_collection(target->client,
+            u_mongo.db, *name);
+        if (!mongoc_collection_drop(coll, &error)) {
+            LOG("MONGO ERROR(%s/%s.%s): %s", target->address, u_mongo.db,
+                *name, error.message);
+        } else {
+            LOG("dropped expired stats collection %s.%s", u_mongo.db, *name);
+        }
+        mongoc_collection_destroy(coll);
+    }
+
+    bson_strfreev(names);
+    mongoc_database_destroy(db);
+}
+
+/**
+ * Returns the handle of the collection stats are pushed to at 'now' on a
+ * target. The handle is cached across pushes and only recreated, for
+ * time-partitioned collections, when the resolved name rotates, at which
+ * point expired partitions are dropped. Must be called with the target
+ * lock held.
+ */
+static mongoc_collection_t *stats_pusher_mongodb_collection(struct uwsgi_mongo_target *target,
+                                                            time_t now) {
+    char name[sizeof(target->partition)];
+
+    if (u_mongo.partitioned) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        if (!strftime(name, sizeof(name), u_mongo.coll, &tm)) {
+            LOG("invalid mongo collection template (%s)", u_mongo.coll);
+            return NULL;
+        }
+    } else {
+        strncpy(name, u_mongo.coll, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+    }
+
+    if ((u_mongo.capped || u_mongo.indexes) && strcmp(name, target->provisioned)) {
+        if (stats_pusher_mongodb_provision(target, name)) {
+            strcpy(target->provisioned, name);
+        }
+    }
+
+    if (target->partition_coll && !strcmp(name, target->partition)) {
+        return target->partition_coll;
+    }
+
+    bool rotated = u_mongo.partitioned && strcmp(name, target->partition);
+
+    if (target->partition_coll) {
+        mongoc_collection_destroy(target->partition_coll);
+    }
+    strcpy(target->partition, name);
+    target->partition_coll = mongoc_client_get_collection(target->client,
+        u_mongo.db, name);
+
+    if (rotated) {
+        DBG("rotated stats collection to %s.%s", u_mongo.db, name);
+        if (u_mongo.retention) {
+            stats_pusher_mongodb_drop_expired(target, now);
+        }
+    }
+    return target->partition_coll;
+}
+
+/**
+ * Returns the long-lived client of a target, popping it from the pool on
+ * first use. Must be called with the target lock held.
+ */
+static mongoc_client_t *stats_pusher_mongodb_client(struct uwsgi_mongo_target *target) {
+    if (!target->client) {
+        target->client = mongoc_client_pool_pop(target->pool);
+    }
+    return target->client;
+}
+
+#define STATS_PUSHER_MONGODB_MAX_FAILURES 2
+
+static double stats_pusher_mongodb_load(const double *value) {
+    double ret;
+    __atomic_load(value, &ret, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void stats_pusher_mongodb_store(double *value, double val) {
+    __atomic_store(value, &val, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records the outcome of a probe or push on a target. The error rate and
+ * round-trip time are exponentially weighted moving averages; a target is
+ * considered down after STATS_PUSHER_MONGODB_MAX_FAILURES consecutive
+ * failures and up again after its next success. Must be called with the
+ * target lock held.
+ */
+static void stats_pusher_mongodb_record(struct uwsgi_mongo_target *target, bool ok,
+                                        uint64_t elapsed_us) {
+    stats_pusher_mongodb_store(&target->error_rate,
+        target->error_rate * 0.8 + (ok ? 0.0 : 0.2));
+    if (ok) {
+        double rtt_ms = elapsed_us / 1000.0;
+        stats_pusher_mongodb_store(&target->rtt_ms,
+            target->rtt_ms ? target->rtt_ms * 0.8 + rtt_ms * 0.2 : rtt_ms);
+        __atomic_store_n(&target->failures, 0, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&target->failures, target->failures + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Whether an error means the target could not be reached, as opposed to
+ * the server rejecting the operation.
+ */
+static bool stats_pusher_mongodb_network_error(const bson_error_t *error) {
+    return error->domain == MONGOC_ERROR_STREAM ||
+        error->domain == MONGOC_ERROR_SERVER_SELECTION;
+}
+
+static bool stats_pusher_mongodb_healthy(struct uwsgi_mongo_target *target) {
+    return __atomic_load_n(&target->failures, __ATOMIC_RELAXED) <
+        STATS_PUSHER_MONGODB_MAX_FAILURES;
+}
+
+/**
+ * Pings a target, updating its health. Must be called with the target
+ * lock held.
+ */
+static bool stats_pusher_mongodb_ping(struct uwsgi_mongo_target *target) {
+    bson_error_t error;
+    bson_t cmd = BSON_INITIALIZER;
+
+    BSON_APPEND_INT32(&cmd, "ping", 1);
+    uint64_t start = uwsgi_micros();
+    bool ok = mongoc_client_command_simple(stats_pusher_mongodb_client(target),
+        "admin", &cmd, NULL, NULL, &error);
+    stats_pusher_mongodb_record(target, ok, uwsgi_micros() - start);
+    if (!ok) {
+        LOG("MONGO ERROR(%s): ping failed: %s", target->address, error.message);
+    }
+    target->used = uwsgi_now();
+    bson_destroy(&cmd);
+    return ok;
+}
+
+/**
+ * Returns the target to push to: the first healthy one in priority
+ * order, or the primary when none is.
+ */
+static struct uwsgi_mongo_target *stats_pusher_mongodb_select_target() {
+    struct uwsgi_mongo_target *target;
+    for (target = u_mongo.targets; target; target = target->next) {
+        if (stats_pusher_mongodb_healthy(target)) break;
+    }
+    if (!target) target = u_mongo.targets;
+
+    struct uwsgi_mongo_target *previous = __atomic_exchange_n(&u_mongo.current,
+        target, __ATOMIC_RELAXED);
+    if (previous && previous != target) {
+        LOG("switching stats target from %s to %s", previous->address,
+            target->address);
+    }
+    return target;
+}
+
+/**
+ * Returns the first healthy target after 'target' in priority order, to
+ * retry a failed push on, or NULL if there is none.
+ */
+static struct uwsgi_mongo_target *stats_pusher_mongodb_next_target(
+        struct uwsgi_mongo_target *target) {
+    for (target = target->next; target; target = target->next) {
+        if (stats_pusher_mongodb_healthy(target)) return target;
+    }
+    return NULL;
+}
+
+static void stats_pusher_mongodb_free_kvals(struct uwsgi_string_list *usl) {
+    while (usl) {
+        struct uwsgi_string_list *next = usl->next;
+        delete (struct uwsgi_mongo_keyval *)usl->custom_ptr;
+        free(usl->value);
+        free(usl);
+        usl = next;
+    }
+}
+
+static void stats_pusher_mongodb_free_reload(struct uwsgi_mongo_reload *reload) {
+    stats_pusher_mongodb_free_kvals(reload->custom_kvals_str);
+    stats_pusher_mongodb_free_kvals(reload->custom_kvals_int);
+    free(reload->db_coll);
+    delete reload;
+}
+
+static std::string stats_pusher_mongodb_trim(const std::string &str) {
+    std::string::size_type start = str.find_first_not_of(" \t\r");
+    if (start == std::string::npos) return "";
+    return str.substr(start, str.find_last_not_of(" \t\r") - start + 1);
+}
+
+/**
+ * Parses mongo-stats-reload-file. It holds "option = value" lines using
+ * the startup option names, of which mongo-stats-freq,
+ * mongo-stats-collection, mongo-stats-kv and mongo-stats-kv-int are
+ * reloadable; anything else (comments, sections, other options) is
+ * ignored, so that an ini file can be used. Values not in the file keep
+ * their startup value; kv lines replace the whole startup list of their
+ * kind. Returns NULL if the file is invalid.
+ */
+static struct uwsgi_mongo_reload *stats_pusher_mongodb_parse_reload(FILE *fp) {
+    auto reload = new uwsgi_mongo_reload();
+    char line[4096];
+
+    reload->freq = u_mongo.startup.freq;
+    while (fgets(line, sizeof(line), fp)) {
+        std::string str(line);
+        str.erase(str.find_last_not_of("\r\n") + 1);
+        std::string::size_type eq = str.find('=');
+        if (eq == std::string::npos) continue;
+        std::string name = stats_pusher_mongodb_trim(str.substr(0, eq));
+        std::string value = stats_pusher_mongodb_trim(str.substr(eq + 1));
+
+        if (name == "mongo-stats-freq") {
+            reload->freq = atoi(value.c_str());
+            if (reload->freq <= 0) {
+                LOG("invalid mongo-stats-freq in %s: %s", u_mongo.reload_file,
+                    value.c_str());
+                goto error;
+            }
+        } else if (name == "mongo-stats-collection") {
+            if (value.find('.') == std::string::npos) {
+                LOG("invalid mongo collection (%s), must be in the form db.collection",
+                    value.c_str());
+                goto error;
+            }
+            free(reload->db_coll);
+            reload->db_coll = uwsgi_str((char *)value.c_str());
+        } else if (name == "mongo-stats-kv" || name == "mongo-stats-kv-int") {
+            bool is_int = (name == "mongo-stats-kv-int");
+            struct uwsgi_string_list *usl = uwsgi_string_new_list(
+                is_int ? &reload->custom_kvals_int : &reload->custom_kvals_str,
+                uwsgi_str((char *)value.c_str()));
+            stats_pusher_mongodb_register_keyval(usl, is_int);
+            if (!usl->custom_ptr) goto error;
+        }
+    }
+    return reload;
+
+error:
+    stats_pusher_mongodb_free_reload(reload);
+    return NULL;
+}
+
+/**
+ * Rereads mongo-stats-reload-file when its mtime changes, and hands the
+ * result over to the pusher, which swaps it in at the start of its next
+ * push. The mtime seen at startup is recorded by post_init, so only later
+ * changes are reloaded.
+ */
+static void stats_pusher_mongodb_check_reload() {
+    struct stat st;
+
+    if (stat(u_mongo.reload_file, &st)) {
+        if (u_mongo.reload_mtime) {
+            uwsgi_error("stats_pusher_mongodb_check_reload()/stat()");
+            u_mongo.reload_mtime = 0;
+        }
+        return;
+    }
+    if (st.st_mtime == u_mongo.reload_mtime) return;
+    u_mongo.reload_mtime = st.st_mtime;
+
+    FILE *fp = fopen(u_mongo.reload_file, "r");
+    if (!fp) {
+        uwsgi_error_open(u_mongo.reload_file);
+        return;
+    }
+    struct uwsgi_mongo_reload *reload = stats_pusher_mongodb_parse_reload(fp);
+    fclose(fp);
+    if (!reload) {
+        LOG("ignoring invalid reload file %s", u_mongo.reload_file);
+        return;
+    }
+
+    pthread_mutex_lock(&u_mongo.reload_lock);
+    if (u_mongo.reload) {
+        stats_pusher_mongodb_free_reload(u_mongo.reload);
+    }
+    u_mongo.reload = reload;
+    pthread_mutex_unlock(&u_mongo.reload_lock);
+    LOG("reloaded configuration from %s", u_mongo.reload_file);
+}
+
+/**
+ * Swaps in the configuration reread by the probe thread, if any. Runs in
+ * the pusher thread between pushes, so a push always sees one consistent
+ * configuration, and is the only writer of the push frequency. All the
+ * collection handles are dropped, since they may point to the previous
+ * database; a slow requests collection defaulted from the database follows
+ * it.
+ */
+static void stats_pusher_mongodb_apply_reload() {
+    pthread_mutex_lock(&u_mongo.reload_lock);
+    struct uwsgi_mongo_reload *reload = u_mongo.reload;
+    u_mongo.reload = NULL;
+    pthread_mutex_unlock(&u_mongo.reload_lock);
+    if (!reload) return;
+
+    char *db_coll = reload->db_coll ? reload->db_coll : u_mongo.startup.db_coll;
+    char *db, *coll;
+    stats_pusher_mongodb_split_ns(db_coll, &db, &coll);
+    bool partitioned = (strchr(coll, '%') != NULL);
+    if (u_mongo.retention && !partitioned) {
+        LOG("mongo-stats-retention requires a time-partitioned collection (%s), "
+            "keeping %s", db_coll, u_mongo.db_coll);
+        free(db);
+    } else {
+        if (u_mongo.db_coll != u_mongo.startup.db_coll) free(u_mongo.db_coll);
+        free(u_mongo.db);
+        u_mongo.db_coll = uwsgi_str(db_coll);
+        u_mongo.db = db;
+        u_mongo.coll = coll;
+        u_mongo.partitioned = partitioned;
+        if (u_mongo.slow_default_ns) {
+            free(u_mongo.slow_db_coll);
+            free(u_mongo.slow_db);
+            u_mongo.slow_db_coll = uwsgi_concat2(u_mongo.db, (char *)".slow_requests");
+            stats_pusher_mongodb_split_ns(u_mongo.slow_db_coll, &u_mongo.slow_db,
+                &u_mongo.slow_coll);
+        }
+    }
+
+    if (u_mongo.custom_kvals_str != u_mongo.startup.custom_kvals_str) {
+        stats_pusher_mongodb_free_kvals(u_mongo.custom_kvals_str);
+    }
+    if (u_mongo.custom_kvals_int != u_mongo.startup.custom_kvals_int) {
+        stats_pusher_mongodb_free_kvals(u_mongo.custom_kvals_int);
+    }
+    u_mongo.custom_kvals_str = reload->custom_kvals_str ?
+        reload->custom_kvals_str : u_mongo.startup.custom_kvals_str;
+    u_mongo.custom_kvals_int = reload->custom_kvals_int ?
+        reload->custom_kvals_int : u_mongo.startup.custom_kvals_int;
+    reload->custom_kvals_str = reload->custom_kvals_int = NULL;
+
+    u_mongo.freq = reload->freq;
+    if (u_mongo.spread) {
+        u_mongo.phase = stats_pusher_mongodb_hash(stats_pusher_mongodb_instance_name())
+            % u_mongo.freq;
+    } else {
+        u_mongo.uspi->freq = u_mongo.freq;
+    }
+
+    struct uwsgi_mongo_target *target;
+    for (target = u_mongo.targets; target; target = target->next) {
+        pthread_mutex_lock(&target->lock);
+        stats_pusher_mongodb_drop_handles(target);
+        pthread_mutex_unlock(&target->lock);
+    }
+
+    stats_pusher_mongodb_free_reload(reload);
+    LOG("now pushing to %s.%s, %is freq", u_mongo.db, u_mongo.coll, u_mongo.freq);
+}
+
+static bool stats_pusher_mongodb_probe_stopping() {
+    pthread_mutex_lock(&u_mongo.probe_lock);
+    bool stop = u_mongo.probe_stop;
+    pthread_mutex_unlock(&u_mongo.probe_lock);
+    return stop;
+}
+
+/**
+ * Sleeps for a second, or less if atexit asks the probe thread to stop.
+ */
+static void stats_pusher_mongodb_probe_wait() {
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 1;
+    pthread_mutex_lock(&u_mongo.probe_lock);
+    if (!u_mongo.probe_stop) {
+        pthread_cond_timedwait(&u_mongo.probe_cond, &u_mongo.probe_lock, &until);
+    }
+    pthread_mutex_unlock(&u_mongo.probe_lock);
+}
+
+/**
+ * Prewarms the connection to every target (topology discovery, TLS
+ * handshake and auth) so that the next push does not pay for it. Then,
+ * every second, pings the targets that have not been used for the probe
+ * interval: mongo-stats-keepalive keeps the connection from being dropped
+ * between pushes, mongo-stats-probe-freq keeps the health of failover
+ * targets current. Probing runs here rather than in the pusher so that a
+ * down target never delays a push; a target busy with a push is skipped.
+ * Runs until atexit sets probe_stop.
+ */
+static void *stats_pusher_mongodb_probe_loop(void *) {
+    struct uwsgi_mongo_target *target;
+    int interval = u_mongo.keepalive;
+
+    if (u_mongo.failover && (!interval || u_mongo.probe_freq < interval)) {
+        interval = u_mongo.probe_freq;
+    }
+
+    sigset_t smask;
+    sigfillset(&smask);
+    pthread_sigmask(SIG_BLOCK, &smask, NULL);
+
+    for (target = u_mongo.targets; target && !stats_pusher_mongodb_probe_stopping();
+            target = target->next) {
+        pthread_mutex_lock(&target->lock);
+        uint64_t start = uwsgi_micros();
+        if (stats_pusher_mongodb_ping(target)) {
+            DBG("connection to %s prewarmed in %s msec", target->address,
+                uwsgi_64bit2str((uwsgi_micros() - start) / 1000));
+        }
+        pthread_mutex_unlock(&target->lock);
+    }
+
+    while ((interval > 0 || u_mongo.reload_file) && !stats_pusher_mongodb_probe_stopping()) {
+        if (u_mongo.reload_file) {
+            stats_pusher_mongodb_check_reload();
+        }
+        stats_pusher_mongodb_probe_wait();
+        if (interval <= 0 || stats_pusher_mongodb_probe_stopping()) continue;
+        for (target = u_mongo.targets; target; target = target->next) {
+            if (pthread_mutex_trylock(&target->lock)) continue;
+            if (uwsgi_now() - target->used >= interval) {
+                bool was_healthy = stats_pusher_mongodb_healthy(target);
+                stats_pusher_mongodb_ping(target);
+                if (was_healthy != stats_pusher_mongodb_healthy(target)) {
+                    LOG("stats target %s is %s", target->address,
+                        was_healthy ? "down" : "up");
+                }
+            }
+            pthread_mutex_unlock(&target->lock);
+        }
     }
+    return NULL;
+}
+
+/**
+ * Acquires a target lock, waiting no longer than what is left of the push
+ * deadline. Returns false if the deadline passed first.
+ */
+static bool stats_pusher_mongodb_lock_target(struct uwsgi_mongo_target *target,
+                                             uint64_t start) {
+    if (!u_mongo.deadline_ms) {
+        pthread_mutex_lock(&target->lock);
+        return true;
+    }
+    struct timespec ts;
+    uint64_t abs_deadline = start + (uint64_t)u_mongo.deadline_ms * 1000;
+    ts.tv_sec = abs_deadline / 1000000;
+    ts.tv_nsec = (abs_deadline % 1000000) * 1000;
+    return pthread_mutex_timedlock(&target->lock, &ts) == 0;
+}
+
+static bool stats_pusher_mongodb_expired(uint64_t start) {
+    return u_mongo.deadline_ms &&
+        uwsgi_micros() - start >= (uint64_t)u_mongo.deadline_ms * 1000;
+}
+
+/**
+ * Whether a failed write may succeed if retried: the target could not be
+ * reached, the server labelled the error retryable, or it is one of the
+ * errors a replica set election or shutdown produces.
+ */
+static bool stats_pusher_mongodb_transient_error(const bson_error_t *error,
+                                                 const bson_t *reply) {
+    static const uint32_t transient_codes[] = {
+        6,     // HostUnreachable
+        7,     // HostNotFound
+        89,    // NetworkTimeout
+        91,    // ShutdownInProgress
+        189,   // PrimarySteppedDown
+        9001,  // SocketException
+        10107, // NotWritablePrimary
+        11600, // InterruptedAtShutdown
+        11602, // InterruptedDueToReplStateChange
+        13435, // NotPrimaryNoSecondaryOk
+        13436, // NotPrimaryOrSecondary
+    };
+
+    if (stats_pusher_mongodb_network_error(error)) return true;
+    if (reply && mongoc_error_has_label(reply, "RetryableWriteError")) return true;
+    for (uint32_t code : transient_codes) {
+        if (error->code == code) return true;
+    }
+    return false;
+}
+
+/**
+ * Inserts the history document, retrying transient failures up to
+ * mongo-stats-retries times with exponential backoff, as long as the
+ * deadline allows. The document carries the _id assigned when the snapshot
+ * was captured, so a duplicate key error on a retry means an earlier
+ * attempt did reach the server (only its reply was lost), and counts as
+ * success. Must be called with the target lock held.
+ */
+static bool stats_pusher_mongodb_insert(struct uwsgi_mongo_target *target,
+                                        mongoc_collection_t *coll,
+                                        const bson_t *doc, uint64_t start) {
+    bson_error_t error;
+    bson_t reply;
+    uint64_t backoff_ms = u_mongo.retry_backoff_ms;
+
+    for (int attempt = 0; ; attempt++) {
+        uint64_t insert_start = uwsgi_micros();
+        bool ok = mongoc_collection_insert_one(coll, doc, u_mongo.write_opts,
+            &reply, &error);
+        if (ok || !stats_pusher_mongodb_network_error(&error)) {
+            stats_pusher_mongodb_record(target, true, uwsgi_micros() - insert_start);
+        } else {
+            stats_pusher_mongodb_record(target, false, 0);
+        }
+
+        if (!ok && attempt > 0 && error.code == 11000) {
+            DBG("stats document already inserted by attempt %d", attempt);
+            ok = true;
+        }
+        bool transient = !ok && stats_pusher_mongodb_transient_error(&error, &reply);
+        bson_destroy(&reply);
+        if (ok) {
+            return true;
+        }
+
+        LOG("MONGO ERROR(%s/%s): %s", target->address, u_mongo.db_coll,
+            error.message);
+        if (!transient || attempt >= u_mongo.retries) {
+            return false;
+        }
+        if (u_mongo.deadline_ms && uwsgi_micros() + backoff_ms * 1000 - start >=
+                (uint64_t)u_mongo.deadline_ms * 1000) {
+            return false;
+        }
+        usleep(backoff_ms * 1000);
+        backoff_ms *= 2;
+        DBG("retrying stats insert (%d/%d)", attempt + 1, u_mongo.retries);
+    }
+}
+
+/**
+ * Handles a document that did not make it into the stats collection:
+ * appends it to mongo-stats-spool as a line of canonical extended JSON,
+ * which keeps the int32, int64 and double types for mongoimport, or,
+ * without a spool, drops it. Called from both the pusher and the events
+ * thread: each line is a single writev() to a file opened with O_APPEND,
+ * so lines of concurrent calls never interleave.
+ */
+static void stats_pusher_mongodb_fallback(const bson_t *bson, const char *reason) {
+    size_t len;
+
+    __atomic_fetch_add(&u_mongo.fallbacks, 1, __ATOMIC_RELAXED);
+    if (u_mongo.spool_fd < 0) {
+        LOG("dropped stats document: %s", reason);
+        return;
+    }
+
+    char *str = bson_as_canonical_extended_json(bson, &len);
+    struct iovec iov[2] = {{str, len}, {(void *)"\n", 1}};
+    if (writev(u_mongo.spool_fd, iov, 2) < 0) {
+        uwsgi_error("stats_pusher_mongodb_fallback()/writev()");
+    } else {
+        DBG("spooled stats document: %s", reason);
+    }
+    bson_free(str);
+}
+
+// Events beyond this many waiting to be written are dropped, oldest first
+#define STATS_PUSHER_MONGODB_MAX_EVENTS 1024
+
+static std::deque<bson_t *> stats_pusher_mongodb_events;
+
+/**
+ * Builds an event document with the state of a worker at the time of the
+ * event, as recorded by the master.
+ */
+static bson_t *stats_pusher_mongodb_event(const char *type, int wid, pid_t old_pid) {
+    struct uwsgi_worker *w = &uwsgi.workers[wid];
+    bson_t *event = bson_new();
+    bson_t worker;
+
+    BSON_APPEND_UTF8(event, "event", type);
+    BSON_APPEND_UTF8(event, "instance", stats_pusher_mongodb_instance_name().c_str());
+    BSON_APPEND_DATE_TIME(event, "time", (int64_t)(uwsgi_micros() / 1000));
+    BSON_APPEND_DOCUMENT_BEGIN(event, "worker", &worker);
+    BSON_APPEND_INT32(&worker, "id", wid);
+    BSON_APPEND_INT32(&worker, "pid", w->pid);
+    if (old_pid) {
+        BSON_APPEND_INT32(&worker, "old_pid", old_pid);
+    }
+    BSON_APPEND_INT64(&worker, "requests", w->requests);
+    BSON_APPEND_INT64(&worker, "exceptions", w->exceptions);
+    BSON_APPEND_INT64(&worker, "harakiri_count", w->harakiri_count);
+    BSON_APPEND_INT64(&worker, "respawn_count", w->respawn_count);
+    BSON_APPEND_INT64(&worker, "avg_rt", w->avg_response_time);
+    BSON_APPEND_INT64(&worker, "rss", w->rss_size);
+    BSON_APPEND_INT64(&worker, "vsz", w->vsz_size);
+    BSON_APPEND_INT64(&worker, "tx", w->tx);
+    BSON_APPEND_INT64(&worker, "last_spawn", w->last_spawn);
+    BSON_APPEND_BOOL(&worker, "busy", w->busy != 0);
+    BSON_APPEND_BOOL(&worker, "cheaped", w->cheaped != 0);
+    bson_append_document_end(event, &worker);
+    return event;
+}
+
+/**
+ * Queues an event for the events thread to write, so that the master
+ * never waits on MongoDB.
+ */
+static void stats_pusher_mongodb_queue_event(bson_t *event) {
+    pthread_mutex_lock(&u_mongo.events_lock);
+    if (stats_pusher_mongodb_events.size() >= STATS_PUSHER_MONGODB_MAX_EVENTS) {
+        bson_destroy(stats_pusher_mongodb_events.front());
+        stats_pusher_mongodb_events.pop_front();
+        __atomic_fetch_add(&u_mongo.events_dropped, 1, __ATOMIC_RELAXED);
+    }
+    stats_pusher_mongodb_events.push_back(event);
+    pthread_cond_signal(&u_mongo.events_cond);
+    pthread_mutex_unlock(&u_mongo.events_lock);
+}
+
+/**
+ * Writes a batch of events with a single insert into the events collection
+ * of the selected target, or hands them to the fallback if that fails or
+ * the target stays busy past the push deadline.
+ */
+static void stats_pusher_mongodb_write_events(std::vector<bson_t *> &events) {
+    bson_error_t error;
+    bool ok = false;
+
+    uint64_t start = uwsgi_micros();
+    struct uwsgi_mongo_target *target = stats_pusher_mongodb_select_target();
+    if (!stats_pusher_mongodb_lock_target(target, start)) {
+        LOG("stats target %s busy, not writing %d events", target->address, (int)events.size());
+    } else {
+        mongoc_client_t *client = stats_pusher_mongodb_client(target);
+        if (client) {
+            if (!target->events_handle) {
+                target->events_handle = mongoc_client_get_collection(client,
+                    u_mongo.events_db, u_mongo.events_coll);
+            }
+            start = uwsgi_micros();
+            ok = mongoc_collection_insert_many(target->events_handle,
+                (const bson_t **)events.data(), events.size(), u_mongo.write_opts, NULL, &error);
+            stats_pusher_mongodb_record(target, ok, uwsgi_micros() - start);
+            if (!ok) {
+                LOG("MONGO ERROR(%s/%s): %s", target->address,
+                    u_mongo.events_db_coll, error.message);
+            }
+            target->used = uwsgi_now();
+        }
+        pthread_mutex_unlock(&target->lock);
+    }
+
+    for (bson_t *event : events) {
+        if (!ok) stats_pusher_mongodb_fallback(event, "event insert failed");
+        bson_destroy(event);
+    }
+    events.clear();
+}
+
+/**
+ * Writes the queued events as they come, in a thread of its own so that
+ * neither the master nor the pushes nor the probes ever wait for them.
+ * Runs until atexit sets events_stop, after writing what is still queued.
+ */
+static void *stats_pusher_mongodb_events_loop(void *) {
+    std::vector<bson_t *> events;
+
+    sigset_t smask;
+    sigfillset(&smask);
+    pthread_sigmask(SIG_BLOCK, &smask, NULL);
+
+    pthread_mutex_lock(&u_mongo.events_lock);
+    for (;;) {
+        while (stats_pusher_mongodb_events.empty() && !u_mongo.events_stop) {
+            pthread_cond_wait(&u_mongo.events_cond, &u_mongo.events_lock);
+        }
+        if (stats_pusher_mongodb_events.empty()) break;
+        events.assign(stats_pusher_mongodb_events.begin(), stats_pusher_mongodb_events.end());
+        stats_pusher_mongodb_events.clear();
+        pthread_mutex_unlock(&u_mongo.events_lock);
+
+        stats_pusher_mongodb_write_events(events);
+
+        pthread_mutex_lock(&u_mongo.events_lock);
+    }
+    pthread_mutex_unlock(&u_mongo.events_lock);
+    return NULL;
+}
+
+static void stats_pusher_mongodb_harakiri(int wid) {
+    if (!u_mongo.targets || !u_mongo.events_db_coll || wid <= 0 || wid > uwsgi.numproc) return;
+    stats_pusher_mongodb_queue_event(stats_pusher_mongodb_event("harakiri", wid, 0));
+}
+
+/**
+ * Creates the pool of every target and starts the probe thread, and the
+ * events thread if mongo-stats-events-collection is set. Runs once, from
+ * the first master cycle (or the first push, should it come first), in
+ * the master after the workers forked: the pools' threads are never
+ * copied into a worker. Workers respawned later do inherit the pools'
+ * sockets, which they never use; the master keeps using them as before.
+ * Starting ahead of the first push lets the probe thread prewarm the
+ * connections before the push needs them, instead of the push waiting
+ * for the prewarm on the target lock.
+ */
+static void stats_pusher_mongodb_start() {
+    struct uwsgi_mongo_target *target;
+
+    for (target = u_mongo.targets; target; target = target->next) {
+        pthread_mutex_lock(&target->lock);
+        target->pool = mongoc_client_pool_new(target->uri);
+        mongoc_client_pool_set_error_api(target->pool, 2);
+        pthread_mutex_unlock(&target->lock);
+    }
+
+    pthread_mutex_init(&u_mongo.probe_lock, NULL);
+    pthread_cond_init(&u_mongo.probe_cond, NULL);
+    if (pthread_create(&u_mongo.probe_thread, NULL, stats_pusher_mongodb_probe_loop, NULL)) {
+        uwsgi_error("stats_pusher_mongodb_start()/pthread_create()");
+    } else {
+        u_mongo.probe_started = true;
+    }
+
+    if (u_mongo.events_db_coll) {
+        if (pthread_create(&u_mongo.events_thread, NULL, stats_pusher_mongodb_events_loop, NULL)) {
+            uwsgi_error("stats_pusher_mongodb_start()/pthread_create()");
+        } else {
+            u_mongo.events_started = true;
+        }
+    }
+}
+
+static pthread_once_t stats_pusher_mongodb_started = PTHREAD_ONCE_INIT;
+
+/**
+ * Starts the targets on the first cycle, then detects workers that exited,
+ * were cheaped, spawned or respawned since the previous master cycle from
+ * the changes of their pid.
+ */
+static void stats_pusher_mongodb_master_cycle() {
+    static std::vector<pid_t> pids;
+    int wid;
+
+    if (!u_mongo.targets) return;
+    pthread_once(&stats_pusher_mongodb_started, stats_pusher_mongodb_start);
+    if (!u_mongo.events_db_coll || !uwsgi.workers) return;
+    if (pids.empty()) {
+        pids.resize(uwsgi.numproc + 1);
+        for (wid = 1; wid <= uwsgi.numproc; wid++) {
+            pids[wid] = uwsgi.workers[wid].pid;
+        }
+        return;
+    }
+
+    for (wid = 1; wid <= uwsgi.numproc; wid++) {
+        pid_t pid = uwsgi.workers[wid].pid;
+        if (pid == pids[wid]) continue;
+        const char *type;
+        if (!pids[wid]) {
+            type = "spawn";
+        } else if (!pid) {
+            type = uwsgi.workers[wid].cheaped ? "cheap" : "exit";
+        } else {
+            type = "respawn";
+        }
+        stats_pusher_mongodb_queue_event(stats_pusher_mongodb_event(type, wid, pids[wid]));
+        pids[wid] = pid;
+    }
+}
+
+static bool stats_pusher_mongodb_compressor_supported(const std::string &name) {
+    if (name == "snappy") return MONGOC_ENABLE_COMPRESSION_SNAPPY;
+    if (name == "zlib") return MONGOC_ENABLE_COMPRESSION_ZLIB;
+    if (name == "zstd") return MONGOC_ENABLE_COMPRESSION_ZSTD;
+    return false;
+}
+
+static void stats_pusher_mongodb_set_uri_int(mongoc_uri_t *uri, const char *option,
+                                             int value) {
+    if (value < 0 || !mongoc_uri_set_option_as_int32(uri, option, value)) {
+        LOG("invalid value for URI option %s: %d", option, value);
+        exit(1);
+    }
+}
+
+/**
+ * Applies the compression, pool and timeout options to a parsed URI. They
+ * override any value given in the target address itself.
+ */
+static void stats_pusher_mongodb_configure_uri(mongoc_uri_t *uri) {
+    if (u_mongo.compressors) {
+        std::string str(u_mongo.compressors);
+        std::string::size_type last = 0, pos;
+        do {
+            pos = str.find(',', last);
+            std::string name = str.substr(last, pos == std::string::npos ?
+                std::string::npos : pos - last);
+            last = pos + 1;
+            if (!stats_pusher_mongodb_compressor_supported(name)) {
+                LOG("compressor '%s' is not supported by this libmongoc build",
+                    name.c_str());
+                exit(1);
+            }
+        } while (pos != std::string::npos);
+        if (!mongoc_uri_set_compressors(uri, u_mongo.compressors)) {
+            LOG("invalid compressors (%s)", u_mongo.compressors);
+            exit(1);
+        }
+    }
+    if (u_mongo.max_pool_size) {
+        stats_pusher_mongodb_set_uri_int(uri, MONGOC_URI_MAXPOOLSIZE,
+            u_mongo.max_pool_size);
+    }
+    if (u_mongo.server_selection_timeout) {
+        stats_pusher_mongodb_set_uri_int(uri, MONGOC_URI_SERVERSELECTIONTIMEOUTMS,
+            u_mongo.server_selection_timeout);
+    }
+    if (u_mongo.socket_timeout) {
+        stats_pusher_mongodb_set_uri_int(uri, MONGOC_URI_SOCKETTIMEOUTMS,
+            u_mongo.socket_timeout);
+    }
+    if (u_mongo.connect_timeout) {
+        stats_pusher_mongodb_set_uri_int(uri, MONGOC_URI_CONNECTTIMEOUTMS,
+            u_mongo.connect_timeout);
+    }
+}
+
+/**
+ * Builds the options passed to every write: the write concern and
+ * bypassDocumentValidation.
+ */
+static bson_t *stats_pusher_mongodb_write_opts() {
+    bson_t *opts = bson_new();
+    mongoc_write_concern_t *wc = mongoc_write_concern_new();
+
+    if (u_mongo.w) {
+        if (!strcmp(u_mongo.w, "majority")) {
+            mongoc_write_concern_set_wmajority(wc, u_mongo.wtimeout);
+        } else {
+            char *end;
+            long w = strtol(u_mongo.w, &end, 10);
+            if (*end || w < 0) {
+                LOG("invalid write concern w (%s), must be a number or majority",
+                    u_mongo.w);
+                exit(1);
+            }
+            mongoc_write_concern_set_w(wc, (int32_t)w);
+        }
+    }
+    if (u_mongo.journal) {
+        mongoc_write_concern_set_journal(wc, true);
+    }
+    if (u_mongo.wtimeout) {
+        mongoc_write_concern_set_wtimeout_int64(wc, u_mongo.wtimeout);
+    }
+    if (!mongoc_write_concern_is_valid(wc)) {
+        LG0("invalid write concern; journal cannot be combined with w=0");
+        exit(1);
+    }
+    if (u_mongo.w || u_mongo.journal || u_mongo.wtimeout) {
+        mongoc_write_concern_append(wc, opts);
+    }
+    if (u_mongo.bypass_validation) {
+        BSON_APPEND_BOOL(opts, "bypassDocumentValidation", true);
+    }
+
+    mongoc_write_concern_destroy(wc);
+    return opts;
+}
+
+static struct uwsgi_mongo_target *stats_pusher_mongodb_add_target(char *address,
+                                                                  int priority) {
+    bson_error_t error;
+    auto target = (struct uwsgi_mongo_target *)uwsgi_calloc(sizeof(struct uwsgi_mongo_target));
+    char *uri_string = uwsgi_concat2((char *)"mongodb://", address);
+
+    target->priority = priority;
+    target->address = address;
+    if (!(target->uri = mongoc_uri_new_with_error(uri_string, &error))) {
+        LOG("failed to parse URI %s: %s", address, error.message);
+        exit(1);
+    }
+    free(uri_string);
+    stats_pusher_mongodb_configure_uri(target->uri);
+    pthread_mutex_init(&target->lock, NULL);
+    return target;
+}
+
+/**
+ * Returns the first time after 'now' at which this instance pushes. With
+ * mongo-stats-spread, each instance pushes at its own phase within the
+ * interval (a hash of its procname and hostname) instead of all instances
+ * started by the same deploy pushing in the same second.
+ */
+static time_t stats_pusher_mongodb_next_push(time_t now) {
+    time_t next = now - now % u_mongo.freq + u_mongo.phase;
+    return next > now ? next : next + u_mongo.freq;
+}
+
+/**
+ * Returns the start of the push interval 'now' belongs to, which is the
+ * same for every instance whatever its phase (and however late its push
+ * runs, up to the interval length), so that documents can be joined
+ * across instances on it.
+ */
+static time_t stats_pusher_mongodb_bucket(time_t now) {
+    time_t t = now - u_mongo.phase;
+    return t - t % u_mongo.freq;
 }
 
 static void stats_pusher_mongodb_post_init() {
     if (!u_mongo.address) return;
     if (!u_mongo.db_coll) u_mongo.db_coll = (char *)"uwsgi.stats";    
     if (!u_mongo.freq) u_mongo.freq = 60;
-    u_mongo.db = uwsgi_str(u_mongo.db_coll);
-    u_mongo.coll = strchr(u_mongo.db, '.');
-    if (!u_mongo.coll) {
-        LOG("invalid mongo collection (%s), must be in the form db.collection",
+    stats_pusher_mongodb_split_ns(u_mongo.db_coll, &u_mongo.db, &u_mongo.coll);
+    u_mongo.partitioned = (strchr(u_mongo.coll, '%') != NULL);
+    if (u_mongo.retention && !u_mongo.partitioned) {
+        LOG("mongo-stats-retention requires a time-partitioned collection (%s)",
             u_mongo.db_coll);
         exit(1);
     }
-    u_mongo.coll[0] = 0;
-    u_mongo.coll++;
-
-    char *uri_string = uwsgi_concat2((char *)"mongodb://", u_mongo.address);
-    bson_error_t error;
+    if (!compile_metric_rules(u_mongo.metric_rules)) {
+        exit(1);
+    }
+    if (u_mongo.latency) {
+        latency_init();
+    }
+    if (u_mongo.slow_ms) {
+        if (!u_mongo.slow_samples) u_mongo.slow_samples = 32;
+        if (!u_mongo.slow_db_coll) {
+            u_mongo.slow_db_coll = uwsgi_concat2(u_mongo.db, (char *)".slow_requests");
+            u_mongo.slow_default_ns = true;
+        }
+        stats_pusher_mongodb_split_ns(u_mongo.slow_db_coll, &u_mongo.slow_db, &u_mongo.slow_coll);
+        slow_init(u_mongo.slow_ms, u_mongo.slow_samples);
+    }
+    if (u_mongo.routes || u_mongo.route_rules) {
+        if (!u_mongo.routes_max) u_mongo.routes_max = 256;
+        if (!routes_init(u_mongo.route_rules, u_mongo.routes_max)) {
+            exit(1);
+        }
+    }
 
-    if (!(u_mongo.uri = mongoc_uri_new_with_error(uri_string, &error))) {
-        LOG("failed to parse URI %s: %s", u_mongo.address, error.message);
+    if (u_mongo.ttl && u_mongo.capped) {
+        LG0("mongo-stats-ttl cannot be combined with mongo-stats-capped; "
+            "a capped collection expires documents by size");
         exit(1);
     }
-    u_mongo.pool = mongoc_client_pool_new(u_mongo.uri);
-    mongoc_client_pool_set_error_api(u_mongo.pool, 2);
+    if (u_mongo.ttl && !u_mongo.date_field) u_mongo.date_field = (char *)"date";
+    if (u_mongo.index_specs || u_mongo.ttl) {
+        u_mongo.indexes = bson_new();
+        std::vector<std::string> names;
+        struct uwsgi_string_list *usl;
+        uwsgi_foreach(usl, u_mongo.index_specs) {
+            names.push_back(stats_pusher_mongodb_add_index(usl->value, 0));
+        }
+        if (u_mongo.ttl) {
+            std::string spec = std::string(u_mongo.date_field) + ":1";
+            // The TTL index already is the {date: 1} index; asking for it
+            // again without expireAfterSeconds is an IndexOptionsConflict
+            std::string name = stats_pusher_mongodb_add_index(spec.c_str(), u_mongo.ttl);
+            if (std::find(names.begin(), names.end(), name) != names.end()) {
+                LOG("mongo-stats-index %s conflicts with the mongo-stats-ttl index "
+                    "on the same field, remove it", spec.c_str());
+                exit(1);
+            }
+        }
+    }
+
+    u_mongo.spool_fd = -1;
+    if (u_mongo.spool) {
+        u_mongo.spool_fd = open(u_mongo.spool, O_WRONLY | O_APPEND | O_CREAT, 0640);
+        if (u_mongo.spool_fd < 0) {
+            uwsgi_error_open(u_mongo.spool);
+            exit(1);
+        }
+    }
+
+    // Without per-operation cancellation in libmongoc, the deadline also
+    // caps server selection and socket timeouts, so that no single network
+    // operation can outlive it.
+    if (u_mongo.deadline_ms) {
+        int *timeouts[] = {&u_mongo.server_selection_timeout,
+            &u_mongo.socket_timeout, &u_mongo.connect_timeout};
+        for (int *timeout : timeouts) {
+            if (!*timeout || *timeout > u_mongo.deadline_ms) {
+                *timeout = u_mongo.deadline_ms;
+            }
+        }
+    }
+
+    if (!u_mongo.probe_freq) u_mongo.probe_freq = 5;
+    if (!u_mongo.retry_backoff_ms) u_mongo.retry_backoff_ms = 100;
+    stats_pusher_mongodb_parse_id_strategy();
+    struct uwsgi_mongo_target **last = &u_mongo.targets;
+    *last = stats_pusher_mongodb_add_target(u_mongo.address, 0);
+    int priority = 1;
+    struct uwsgi_string_list *usl;
+    uwsgi_foreach(usl, u_mongo.failover) {
+        last = &(*last)->next;
+        *last = stats_pusher_mongodb_add_target(usl->value, priority++);
+    }
+    u_mongo.write_opts = stats_pusher_mongodb_write_opts();
 
     struct uwsgi_stats_pusher_instance *uspi = uwsgi_stats_pusher_add(
         u_mongo.pusher, NULL);
     uspi->freq = u_mongo.freq;
+    u_mongo.uspi = uspi;
+    if (u_mongo.spread) {
+        u_mongo.phase = stats_pusher_mongodb_hash(stats_pusher_mongodb_instance_name())
+            % u_mongo.freq;
+        if (!u_mongo.bucket_field) u_mongo.bucket_field = (char *)"bucket";
+        uspi->last_run = stats_pusher_mongodb_next_push(uwsgi_now()) - u_mongo.freq;
+        DBG("pushing at %is into each %is interval", u_mongo.phase, u_mongo.freq);
+    }
 
-    struct uwsgi_string_list *usl;
     uwsgi_foreach(usl, u_mongo.custom_kvals_str) {
         stats_pusher_mongodb_register_keyval(usl, false);
     }
@@ -182,6 +1808,44 @@ static void stats_pusher_mongodb_post_init() {
         stats_pusher_mongodb_register_keyval(usl, true);
     }
 
+    if (u_mongo.latest_db_coll) {
+        stats_pusher_mongodb_split_ns(u_mongo.latest_db_coll,
+            &u_mongo.latest_db, &u_mongo.latest_coll);
+    }
+    if (u_mongo.counters_db_coll) {
+        stats_pusher_mongodb_split_ns(u_mongo.counters_db_coll,
+            &u_mongo.counters_db, &u_mongo.counters_coll);
+        if (!u_mongo.counters_bucket) u_mongo.counters_bucket = 3600;
+    }
+    if (u_mongo.latest_db_coll || u_mongo.counters_db_coll) {
+        if (!u_mongo.latest_keys) {
+            uwsgi_string_new_list(&u_mongo.latest_keys, (char *)"/procname");
+        }
+        uwsgi_foreach(usl, u_mongo.latest_keys) {
+            stats_pusher_mongodb_register_latest_key(usl);
+        }
+        u_mongo.upsert_opts = bson_copy(u_mongo.write_opts);
+        BSON_APPEND_BOOL(u_mongo.upsert_opts, "upsert", true);
+    }
+
+    u_mongo.startup.freq = u_mongo.freq;
+    u_mongo.startup.db_coll = u_mongo.db_coll;
+    u_mongo.startup.custom_kvals_str = u_mongo.custom_kvals_str;
+    u_mongo.startup.custom_kvals_int = u_mongo.custom_kvals_int;
+    pthread_mutex_init(&u_mongo.reload_lock, NULL);
+    if (u_mongo.reload_file) {
+        struct stat st;
+        if (!stat(u_mongo.reload_file, &st)) {
+            u_mongo.reload_mtime = st.st_mtime;
+        }
+    }
+    if (u_mongo.events_db_coll) {
+        stats_pusher_mongodb_split_ns(u_mongo.events_db_coll,
+            &u_mongo.events_db, &u_mongo.events_coll);
+        pthread_mutex_init(&u_mongo.events_lock, NULL);
+        pthread_cond_init(&u_mongo.events_cond, NULL);
+    }
+
     uspi->configured = 1;
 
     LOG("plugin started, mongodb://%s/%s.%s, %is freq",
@@ -193,56 +1857,274 @@ static void stats_pusher_mongodb_push(struct uwsgi_stats_pusher_instance *uspi,
     bson_error_t error;
     mongoc_collection_t *coll;
     mongoc_client_t *client;
-    bson_t *bson;
+    struct uwsgi_mongo_target *target;
+    bson_t *bson = NULL;
+    bson_t history = BSON_INITIALIZER;
+    bson_t *filter = NULL;
+    bson_t *bucket_filter = NULL;
+    bson_t *update = NULL;
+    std::vector<bson_t *> slow;
+    bool slow_written = false;
+    json inc;
     bson_oid_t oid;
-    json doc;
+    stats_snapshot stats;
 
-    if (!u_mongo.pool) return;
+    if (!u_mongo.targets) return;
     if (uwsgi.mywid > 0) {
         LOG("skipping stats; not master but %i", uwsgi.mywid);
     }
 
     uint64_t start_push = uwsgi_micros();
+    bson_oid_init(&oid, NULL);
+
+    pthread_once(&stats_pusher_mongodb_started, stats_pusher_mongodb_start);
+
+    if (u_mongo.reload_file) {
+        stats_pusher_mongodb_apply_reload();
+    }
+
+    // uWSGI runs the next push 'freq' seconds after this one; steer that
+    // to the next phase-aligned time so that late pushes do not drift
+    if (u_mongo.spread) {
+        uspi->freq = stats_pusher_mongodb_next_push(now) - now;
+    }
 
     try {
-        doc = json::parse(std::string(json_str, json_len));
+        stats = parse_stats(json_str, json_len);
     } catch (json::exception &e) {
         LOG("ERROR(JSON): %s", e.what());
         return;
     }
+    json &doc = stats.doc;
     if (uwsgi.procname_master) {
         doc["procname"] = uwsgi.procname_master;
     } else if (uwsgi.procname) {
         doc["procname"] = uwsgi.procname;
     }
 
-    stats_pusher_mongodb_update_doc(doc);
-    transform_metrics(doc);
+    stats_pusher_mongodb_update_doc(stats);
+    transform_metrics(stats);
 
-    client = mongoc_client_pool_pop(u_mongo.pool);
-    coll = mongoc_client_get_collection(client, u_mongo.db, u_mongo.coll);
+    target = stats_pusher_mongodb_select_target();
 
-    std::string str = doc.dump();
-    if (!(bson = bson_new_from_json((const uint8_t *)str.c_str(), -1, &error))) {
+    if (u_mongo.deadline_ms) {
+        doc["pusher"]["deadline_ms"] = u_mongo.deadline_ms;
+        doc["pusher"]["deadline_misses"] = u_mongo.deadline_misses;
+        doc["pusher"]["fallbacks"] = __atomic_load_n(&u_mongo.fallbacks, __ATOMIC_RELAXED);
+    }
+    if (u_mongo.events_db_coll) {
+        doc["pusher"]["events_dropped"] =
+            __atomic_load_n(&u_mongo.events_dropped, __ATOMIC_RELAXED);
+    }
+    if (u_mongo.slow_ms) {
+        doc["pusher"]["slow_dropped"] = u_mongo.slow_dropped;
+    }
+    if (u_mongo.failover) {
+        // Targets are identified by priority: addresses may hold credentials
+        doc["pusher"]["target"] = target->priority;
+        struct uwsgi_mongo_target *t;
+        for (t = u_mongo.targets; t; t = t->next) {
+            doc["pusher"]["targets"].push_back({
+                {"priority", t->priority},
+                {"healthy", stats_pusher_mongodb_healthy(t)},
+                {"rtt_ms", stats_pusher_mongodb_load(&t->rtt_ms)},
+                {"error_rate", stats_pusher_mongodb_load(&t->error_rate)},
+            });
+        }
+    }
+
+    if (u_mongo.counters_db_coll || u_mongo.summary) {
+        counter_snapshot(stats);
+    }
+    if (u_mongo.counters_db_coll) {
+        inc = counter_deltas();
+    }
+    if (u_mongo.latency) {
+        json latency = latency_histogram();
+        if (!latency.is_null()) {
+            doc["latency"] = std::move(latency);
+        }
+    }
+    if (u_mongo.routes || u_mongo.route_rules) {
+        json routes = routes_drain();
+        if (!routes.is_null()) {
+            doc["routes"] = std::move(routes);
+        }
+    }
+    if (u_mongo.slow_ms) {
+        uint64_t seen;
+        json samples = slow_drain(&seen);
+        doc["slow_requests"] = seen;
+        std::string instance = stats_pusher_mongodb_instance(doc);
+        for (auto &sample : samples) {
+            int64_t time_ms = sample["time_ms"];
+            sample.erase("time_ms");
+            sample["instance"] = instance;
+            std::string str = sample.dump(-1, ' ', false, json::error_handler_t::replace);
+            bson_t *b = bson_new_from_json((const uint8_t *)str.c_str(), -1, &error);
+            if (!b) {
+                LOG("BSON ERROR(%s/%s): %s", u_mongo.address, u_mongo.slow_db_coll,
+                    error.message);
+                continue;
+            }
+            BSON_APPEND_DATE_TIME(b, "time", time_ms);
+            slow.push_back(b);
+        }
+    }
+    if (u_mongo.summary) {
+        json summary = worker_summary(stats);
+        if (!summary.is_null()) {
+            doc["summary"] = std::move(summary);
+        }
+    }
+    if (u_mongo.sparse || u_mongo.sparse_top) {
+        sparse_workers(stats, u_mongo.sparse_top);
+    }
+
+    if (!(bson = stats_to_bson(stats, u_mongo.convert_threads, &error))) {
         LOG("BSON ERROR(%s/%s): %s", u_mongo.address, u_mongo.db_coll,
             error.message);
         goto done;
     }
 
-    bson_oid_init(&oid, NULL);
-    BSON_APPEND_OID(bson, "_id", &oid);
+    if (u_mongo.date_field) {
+        BSON_APPEND_DATE_TIME(bson, u_mongo.date_field, (int64_t)now * 1000);
+    }
+    if (u_mongo.bucket_field) {
+        BSON_APPEND_DATE_TIME(bson, u_mongo.bucket_field,
+            (int64_t)stats_pusher_mongodb_bucket(now) * 1000);
+    }
+
+    // The history document gets the snapshot _id first; the latest-state
+    // document is a replacement, which must not carry it.
+    stats_pusher_mongodb_append_id(&history, &oid, stats_pusher_mongodb_instance(doc),
+        start_push / 1000);
+    bson_concat(&history, bson);
+
+    if (!stats_pusher_mongodb_lock_target(target, start_push)) {
+        stats_pusher_mongodb_fallback(&history, "deadline exceeded waiting for the client");
+        goto done;
+    }
+    client = stats_pusher_mongodb_client(target);
+
+    if (stats_pusher_mongodb_expired(start_push)) {
+        stats_pusher_mongodb_fallback(&history, "deadline exceeded before insert");
+        goto unlock;
+    }
 
-    if (!mongoc_collection_insert_one(coll, bson, NULL, NULL, &error)) {
-       LOG("MONGO ERROR(%s/%s): %s", u_mongo.address, u_mongo.db_coll,
-           error.message);
+    if (!(coll = stats_pusher_mongodb_collection(target, now))) {
+        stats_pusher_mongodb_fallback(&history, "no stats collection");
+        goto unlock;
     }
 
+    // A failed insert is retried on the next healthy target, if the
+    // deadline allows, before giving up on the document
+    while (!stats_pusher_mongodb_insert(target, coll, &history, start_push)) {
+        struct uwsgi_mongo_target *next = stats_pusher_mongodb_next_target(target);
+        if (!next || stats_pusher_mongodb_expired(start_push)) {
+            stats_pusher_mongodb_fallback(&history, "insert failed");
+            break;
+        }
+        target->used = uwsgi_now();
+        pthread_mutex_unlock(&target->lock);
+        target = next;
+        LOG("retrying stats insert on %s", target->address);
+        if (!stats_pusher_mongodb_lock_target(target, start_push)) {
+            stats_pusher_mongodb_fallback(&history, "deadline exceeded waiting for the client");
+            goto done;
+        }
+        client = stats_pusher_mongodb_client(target);
+        if (!(coll = stats_pusher_mongodb_collection(target, now))) {
+            stats_pusher_mongodb_fallback(&history, "no stats collection");
+            goto unlock;
+        }
+    }
+
+    if (u_mongo.latest_db_coll && !stats_pusher_mongodb_expired(start_push)) {
+        if (!(filter = stats_pusher_mongodb_latest_filter(stats, &error))) {
+            LOG("BSON ERROR(%s/%s): %s", target->address,
+                u_mongo.latest_db_coll, error.message);
+        } else {
+            if (!target->latest_handle) {
+                target->latest_handle = mongoc_client_get_collection(client,
+                    u_mongo.latest_db, u_mongo.latest_coll);
+            }
+            if (!mongoc_collection_replace_one(target->latest_handle, filter, bson,
+                    u_mongo.upsert_opts, NULL, &error)) {
+                LOG("MONGO ERROR(%s/%s): %s", target->address,
+                    u_mongo.latest_db_coll, error.message);
+            }
+        }
+    }
+
+    if (!inc.empty() && !stats_pusher_mongodb_expired(start_push)) {
+        std::string inc_str = json({{"$inc", inc}}).dump();
+        if (!(bucket_filter = stats_pusher_mongodb_latest_filter(stats, &error)) ||
+                !(update = bson_new_from_json((const uint8_t *)inc_str.c_str(),
+                    -1, &error))) {
+            LOG("BSON ERROR(%s/%s): %s", target->address,
+                u_mongo.counters_db_coll, error.message);
+            goto unlock;
+        }
+        BSON_APPEND_DATE_TIME(bucket_filter, "bucket",
+            (int64_t)(now - now % u_mongo.counters_bucket) * 1000);
+
+        if (!target->counters_handle) {
+            target->counters_handle = mongoc_client_get_collection(client,
+                u_mongo.counters_db, u_mongo.counters_coll);
+        }
+        if (!mongoc_collection_update_one(target->counters_handle, bucket_filter,
+                update, u_mongo.upsert_opts, NULL, &error)) {
+            LOG("MONGO ERROR(%s/%s): %s", target->address,
+                u_mongo.counters_db_coll, error.message);
+        } else {
+            counter_deltas_commit();
+        }
+    }
+
+    // All the samples of a push go in a single bulk insert
+    if (!slow.empty() && !stats_pusher_mongodb_expired(start_push)) {
+        if (!target->slow_handle) {
+            target->slow_handle = mongoc_client_get_collection(client,
+                u_mongo.slow_db, u_mongo.slow_coll);
+        }
+        if (!mongoc_collection_insert_many(target->slow_handle, (const bson_t **)slow.data(),
+                slow.size(), u_mongo.write_opts, NULL, &error)) {
+            LOG("MONGO ERROR(%s/%s): %s", target->address,
+                u_mongo.slow_db_coll, error.message);
+        } else {
+            slow_written = true;
+        }
+    }
+
+unlock:
+    target->used = uwsgi_now();
+    pthread_mutex_unlock(&target->lock);
+
 done:
     uint64_t end_push = uwsgi_micros();
 
+    if (u_mongo.deadline_ms &&
+            end_push - start_push > (uint64_t)u_mongo.deadline_ms * 1000) {
+        u_mongo.deadline_misses++;
+        LOG("push exceeded the %dms deadline (%s msec)", u_mongo.deadline_ms,
+            uwsgi_64bit2str((end_push - start_push) / 1000));
+    }
+    // Samples are drained from the reservoirs: those not written are
+    // counted in the pusher stats of the next push
+    if (!slow.empty() && !slow_written) {
+        u_mongo.slow_dropped += slow.size();
+        LOG("dropped %s slow request samples", uwsgi_64bit2str(slow.size()));
+    }
+
     if (bson) bson_destroy(bson);
-    if (client) mongoc_client_pool_push(u_mongo.pool, client);
-    if (coll) mongoc_collection_destroy(coll);
+    bson_destroy(&history);
+    if (filter) bson_destroy(filter);
+    if (bucket_filter) bson_destroy(bucket_filter);
+    if (update) bson_destroy(update);
+    for (bson_t *b : slow) {
+        bson_destroy(b);
+    }
 
     DBG("finished in %s msec", uwsgi_64bit2str((end_push - start_push) / 1000));
 }
@@ -271,12 +2153,12 @@ extern "C" struct uwsgi_plugin stats_pusher_mongodb_plugin = {
     .postinit_apps = NULL,
     .fixup = NULL,
     .master_fixup = NULL,
-    .master_cycle = NULL,
+    .master_cycle = stats_pusher_mongodb_master_cycle,
     .mount_app = NULL,
     .manage_udp = NULL,
     .suspend = NULL,
     .resume = NULL,
-    .harakiri = NULL,
+    .harakiri = stats_pusher_mongodb_harakiri,
     .hijack_worker = NULL,
     .spooler_init = NULL,
     .atexit = stats_pusher_mongodb_atexit
@@ -0,0 +1,323 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <regex.h>
+#include <sched.h>
+#include "json.hpp"
+#include "fnv.h"
+using json = nlohmann::json;
+
+extern struct uwsgi_server uwsgi;
+
+#define ROUTE_MAX 96
+#define ROUTE_PATH_MAX 1024
+#define ROUTE_CACHE_SIZE 64
+#define ROUTE_CACHE_PATH 128
+
+/**
+ * A path normalization rule, set with mongo-stats-route as
+ * "<prefix> <route>" or "~<regex> <route>": requests whose path starts
+ * with the prefix, or matches the (POSIX extended) regex, are counted
+ * under the route. Rules are tried in order.
+ */
+struct route_rule {
+    std::string prefix;
+    bool is_regex;
+    regex_t regex;
+    std::string route;
+};
+
+/**
+ * A slot of the routes table. A slot is claimed by setting its hash,
+ * then its route name is written and published by setting ready; the
+ * counters are bumped by any process that finds the hash and the route
+ * name, so that routes with colliding hashes get slots of their own.
+ */
+struct route_entry {
+    uint64_t hash;
+    uint32_t ready;
+    char route[ROUTE_MAX];
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t sum_us;
+};
+
+/**
+ * Open-addressed table of route counters in memory shared by the workers
+ * and the master. No more than 'max' routes get a slot of their own; the
+ * requests of any other route are counted in 'other'.
+ */
+struct route_table {
+    uint64_t size;
+    uint64_t max;
+    uint64_t used;
+    struct route_entry other;
+    struct route_entry entries[];
+};
+
+/**
+ * The rule a recent path matched (-1 for none), cached per thread so that
+ * the regexes of the rules run once per distinct path rather than on
+ * every request. Entries are indexed by the hash of the path, and paths
+ * too long for an entry are not cached.
+ */
+struct route_cache_entry {
+    uint64_t hash;
+    int rule;
+    uint32_t len;
+    char path[ROUTE_CACHE_PATH];
+};
+
+static std::vector<route_rule> route_rules;
+static bool route_regexes = false;
+static struct route_table *routes = NULL;
+static __thread struct route_cache_entry *route_cache = NULL;
+
+static uint64_t route_hash(const char *route, size_t len) {
+    uint64_t hash = fnv1a_64(route, len);
+    // 0 marks a free slot
+    return hash ? hash : 1;
+}
+
+// Whether a path segment looks like an identifier: a number, a uuid or a
+// long hex string with at least one digit
+static bool is_id_segment(const char *s, size_t len) {
+    bool digits = true, hex = true, digit = false;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c >= '0' && c <= '9') {
+            digit = true;
+            continue;
+        }
+        digits = false;
+        if (!((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || c == '-')) hex = false;
+    }
+    return len && (digits || (hex && digit && len >= 8));
+}
+
+// Index of the first rule matching a NUL-terminated path, or -1
+static int route_rule_for(const char *path, size_t len) {
+    struct route_cache_entry *entry = NULL;
+
+    if (route_regexes && len < ROUTE_CACHE_PATH) {
+        if (!route_cache) {
+            route_cache = (struct route_cache_entry *)uwsgi_calloc(
+                ROUTE_CACHE_SIZE * sizeof(struct route_cache_entry));
+        }
+        uint64_t hash = route_hash(path, len);
+        entry = &route_cache[hash % ROUTE_CACHE_SIZE];
+        if (entry->hash == hash && entry->len == len && !memcmp(entry->path, path, len)) {
+            return entry->rule;
+        }
+        entry->hash = hash;
+        entry->len = len;
+        memcpy(entry->path, path, len);
+    }
+
+    int found = -1;
+    for (size_t i = 0; i < route_rules.size(); i++) {
+        const route_rule &rule = route_rules[i];
+        bool match = rule.is_regex
+            ? regexec(&rule.regex, path, 0, NULL, 0) == 0
+            : !strncmp(path, rule.prefix.c_str(), rule.prefix.size());
+        if (match) {
+            found = (int)i;
+            break;
+        }
+    }
+    if (entry) entry->rule = found;
+    return found;
+}
+
+/**
+ * Normalizes a request path into its route: by the first matching rule,
+ * or else by replacing identifier segments with ":id", so that e.g.
+ * /users/42/orders/9f1c2e7a0b becomes /users/:id/orders/:id.
+ */
+static size_t route_of(const char *path, size_t len, char *route) {
+    char buf[ROUTE_PATH_MAX];
+
+    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+    memcpy(buf, path, len);
+    buf[len] = 0;
+
+    int rule = route_rules.empty() ? -1 : route_rule_for(buf, len);
+    if (rule >= 0) {
+        const std::string &name = route_rules[rule].route;
+        size_t n = std::min(name.size(), (size_t)ROUTE_MAX - 1);
+        memcpy(route, name.c_str(), n);
+        route[n] = 0;
+        return n;
+    }
+
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len && n < ROUTE_MAX - 1) {
+        if (buf[i] == '/') {
+            route[n++] = buf[i++];
+            continue;
+        }
+        size_t end = i;
+        while (end < len && buf[end] != '/') end++;
+        const char *segment = buf + i;
+        size_t segment_len = end - i;
+        if (is_id_segment(segment, segment_len)) {
+            segment = ":id";
+            segment_len = 3;
+        }
+        size_t copy = std::min(segment_len, (size_t)ROUTE_MAX - 1 - n);
+        memcpy(route + n, segment, copy);
+        n += copy;
+        i = end;
+    }
+    route[n] = 0;
+    return n;
+}
+
+/**
+ * Whether a slot with the hash of a route holds that route. The name of a
+ * slot claimed an instant ago may not be published yet: it is waited for
+ * briefly, then given up on.
+ */
+static bool route_entry_is(struct route_entry *e, const char *route) {
+    for (int spins = 0; !__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE); spins++) {
+        if (spins >= 1000) return false;
+        sched_yield();
+    }
+    return !strcmp(e->route, route);
+}
+
+static struct route_entry *route_entry_for(const char *route, size_t len) {
+    uint64_t hash = route_hash(route, len);
+    uint64_t mask = routes->size - 1;
+
+    for (uint64_t i = 0; i <= mask; i++) {
+        struct route_entry *e = &routes->entries[(hash + i) & mask];
+        uint64_t cur = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+        if (!cur) {
+            // A new route: take one of the 'max' places, then claim the slot
+            if (__atomic_fetch_add(&routes->used, 1, __ATOMIC_RELAXED) >= routes->max) {
+                __atomic_fetch_sub(&routes->used, 1, __ATOMIC_RELAXED);
+                return &routes->other;
+            }
+            if (__atomic_compare_exchange_n(&e->hash, &cur, hash, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                memcpy(e->route, route, len + 1);
+                __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+                return e;
+            }
+            // Claimed meanwhile: cur is now the hash of its route
+            __atomic_fetch_sub(&routes->used, 1, __ATOMIC_RELAXED);
+        }
+        if (cur == hash && route_entry_is(e, route)) return e;
+    }
+    return &routes->other;
+}
+
+/**
+ * after_request hook: counts the request, its latency and whether it
+ * failed (a 5xx status) under its route.
+ */
+extern "C" void stats_pusher_mongodb_routes_after_request(struct wsgi_request *wsgi_req) {
+    char route[ROUTE_MAX];
+
+    if (!wsgi_req->path_info) {
+        return;
+    }
+    size_t len = route_of(wsgi_req->path_info, wsgi_req->path_info_len, route);
+    struct route_entry *e = route_entry_for(route, len);
+
+    uint64_t us = wsgi_req->end_of_request > wsgi_req->start_of_request
+        ? wsgi_req->end_of_request - wsgi_req->start_of_request : 0;
+    __atomic_fetch_add(&e->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->sum_us, us, __ATOMIC_RELAXED);
+    if (wsgi_req->status >= 500) {
+        __atomic_fetch_add(&e->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Compiles the route rules, allocates the routes table in shared memory
+ * for at most 'max' routes and registers the after_request hook. Must run
+ * in the master before the workers fork. Returns false if a rule is
+ * invalid.
+ */
+bool routes_init(struct uwsgi_string_list *specs, int max) {
+    struct uwsgi_string_list *usl;
+
+    uwsgi_foreach(usl, specs) {
+        std::string spec = usl->value;
+        std::string::size_type space = spec.find_last_of(' ');
+        if (space == std::string::npos || space == 0 || space == spec.size() - 1) {
+            uwsgi_log("[stats-pusher-mongodb] invalid route rule: %s\n", usl->value);
+            return false;
+        }
+        route_rule rule;
+        rule.prefix = spec.substr(0, space);
+        rule.route = spec.substr(space + 1);
+        rule.is_regex = rule.prefix[0] == '~';
+        if (rule.is_regex &&
+                regcomp(&rule.regex, rule.prefix.c_str() + 1, REG_EXTENDED | REG_NOSUB)) {
+            uwsgi_log("[stats-pusher-mongodb] invalid route regex: %s\n", usl->value);
+            return false;
+        }
+        route_rules.push_back(rule);
+        route_regexes |= rule.is_regex;
+    }
+
+    uint64_t size = 1;
+    while (size < (uint64_t)max * 2) size <<= 1;
+    routes = (struct route_table *)uwsgi_calloc_shared(
+        sizeof(struct route_table) + size * sizeof(struct route_entry));
+    routes->size = size;
+    routes->max = max;
+    strcpy(routes->other.route, "other");
+
+    usl = uwsgi_string_new_list(&uwsgi.after_request_hooks,
+        (char *)"stats_pusher_mongodb_routes_after_request");
+    usl->custom_ptr = (void *)stats_pusher_mongodb_routes_after_request;
+    return true;
+}
+
+static void route_drain(struct route_entry *e, const char *route, json &out) {
+    uint64_t requests = __atomic_exchange_n(&e->requests, 0, __ATOMIC_RELAXED);
+    uint64_t errors = __atomic_exchange_n(&e->errors, 0, __ATOMIC_RELAXED);
+    uint64_t sum_us = __atomic_exchange_n(&e->sum_us, 0, __ATOMIC_RELAXED);
+    if (!requests) return;
+    out.push_back({
+        {"route", route},
+        {"requests", requests},
+        {"errors", errors},
+        {"sum_us", sum_us},
+        {"mean_us", sum_us / requests},
+    });
+}
+
+/**
+ * Drains the routes table: returns the routes that served requests since
+ * the previous push, as
+ *
+ *     [{"route": "/users/:id", "requests": 120, "errors": 1,
+ *       "sum_us": 964000, "mean_us": 8033}, ...]
+ *
+ * with the requests of routes past the cap under the route "other". Once
+ * seen, a route keeps its slot, so the cap bounds the number of distinct
+ * routes over the lifetime of the instance. Returns null without requests.
+ */
+json routes_drain() {
+    if (!routes) {
+        return nullptr;
+    }
+    json out = json::array();
+    for (uint64_t i = 0; i < routes->size; i++) {
+        struct route_entry *e = &routes->entries[i];
+        if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) continue;
+        route_drain(e, e->route, out);
+    }
+    route_drain(&routes->other, routes->other.route, out);
+    if (out.empty()) {
+        return nullptr;
+    }
+    return out;
+}
@@ -0,0 +1,155 @@
+#include <uwsgi.h>
+#include <cstring>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/**
+ * Bulk scanning for the stats parser: finding the end of a run of plain
+ * string characters and of a run of whitespace, 16 or 32 bytes at a time
+ * with SSE2 or AVX2 where the CPU has them, chosen at first use, and byte
+ * by byte elsewhere.
+ */
+
+static inline bool plain(unsigned char c) {
+    return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+static inline bool ws(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static const char *scan_string_scalar(const char *p, const char *end) {
+    while (p < end && plain(*p)) p++;
+    return p;
+}
+
+static const char *scan_ws_scalar(const char *p, const char *end) {
+    while (p < end && ws(*p)) p++;
+    return p;
+}
+
+#ifdef SCAN_X86
+// Bytes below 0x20 and from 0x80 up are both negative or below 0x20 as
+// signed chars, so a single signed compare catches controls and non-ASCII
+__attribute__((target("sse2")))
+static const char *scan_string_sse2(const char *p, const char *end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_cmplt_epi8(v, space));
+        int mask = _mm_movemask_epi8(stop);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_string_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_string_avx2(const char *p, const char *end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(0x20);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i stop = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_cmpgt_epi8(space, v));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_string_sse2(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char *scan_ws_sse2(const char *p, const char *end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i tab = _mm_set1_epi8('\t');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i blank = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, nl)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, tab)));
+        int mask = ~_mm_movemask_epi8(blank) & 0xffff;
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_ws_scalar(p, end);
+}
+#endif
+
+static const char *(*string_impl)(const char *, const char *) = NULL;
+static const char *(*ws_impl)(const char *, const char *) = NULL;
+
+static void scan_init() {
+    string_impl = scan_string_scalar;
+    ws_impl = scan_ws_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        string_impl = scan_string_sse2;
+        ws_impl = scan_ws_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        string_impl = scan_string_avx2;
+    }
+#endif
+}
+
+/**
+ * Returns the first byte from p that ends a run of plain string
+ * characters: a quote, a backslash, a control character or non-ASCII.
+ */
+const char *scan_string(const char *p, const char *end) {
+    // Most keys and values are short: try the first bytes in place
+    for (int i = 0; i < 8; i++, p++) {
+        if (p >= end || !plain(*p)) return p;
+    }
+    if (!string_impl) scan_init();
+    return string_impl(p, end);
+}
+
+/**
+ * Returns the first byte from p that is not JSON whitespace.
+ */
+const char *scan_ws(const char *p, const char *end) {
+    // Separators are mostly followed by no or a couple of blanks
+    for (int i = 0; i < 2; i++, p++) {
+        if (p >= end || !ws(*p)) return p;
+    }
+    if (!ws_impl) scan_init();
+    return ws_impl(p, end);
+}
+
+/**
+ * Decodes the 8 bytes at p if they are all digits, with a few word wide
+ * operations instead of 8 multiply-adds.
+ */
+bool scan_digits8(const char *p, uint64_t &value) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    // Every byte between '0' and '9': no high nibble other than 3, and no
+    // carry into the high nibble when adding 6
+    if ((v & 0xf0f0f0f0f0f0f0f0ULL) != 0x3030303030303030ULL ||
+            ((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) != 0x3030303030303030ULL) {
+        return false;
+    }
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000ff000000ffULL) * 0x000f424000000064ULL) +
+         (((v >> 16) & 0x000000ff000000ffULL) * 0x0000271000000001ULL)) >> 32;
+    value = v;
+    return true;
+}
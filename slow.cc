@@ -0,0 +1,180 @@
+#include <uwsgi.h>
+#include <string>
+#include <algorithm>
+#include "json.hpp"
+using json = nlohmann::json;
+
+extern struct uwsgi_server uwsgi;
+
+#define SLOW_PATH_MAX 128
+#define SLOW_METHOD_MAX 16
+
+/**
+ * A captured slow request. seq is a per-slot seqlock: odd while a core is
+ * writing the slot, which the pusher skips, and bumped by two on every
+ * write, so a read racing with a write is detected and dropped. period is
+ * the drain period the request was counted in.
+ */
+struct slow_sample {
+    uint32_t seq;
+    uint16_t status;
+    uint16_t core;
+    uint32_t period;
+    uint64_t duration_us;
+    uint64_t time_ms;
+    char method[SLOW_METHOD_MAX];
+    char path[SLOW_PATH_MAX];
+};
+
+/**
+ * Per-worker reservoir of the slow requests since the previous push: the
+ * n-th slow request replaces a random slot with probability size / n, so
+ * the slots hold a uniform sample of all of them. 'state' holds the drain
+ * period in its high 32 bits and the number of slow requests seen in it
+ * in the low ones, so that a request is counted in, and its sample
+ * stamped with, the period the pusher drains it with.
+ */
+struct slow_ring {
+    uint64_t state;
+    struct slow_sample samples[];
+};
+
+static uint64_t slow_threshold_us = 0;
+static int slow_size = 0;
+static int slow_count = 0;
+static char *slow_rings = NULL;
+
+static struct slow_ring *slow_ring_of(int wid) {
+    return (struct slow_ring *)(slow_rings + wid *
+        (sizeof(struct slow_ring) + slow_size * sizeof(struct slow_sample)));
+}
+
+static void copy_field(char *dst, size_t size, const char *src, size_t len) {
+    if (!src) len = 0;
+    len = std::min(len, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+/**
+ * after_request hook, registered by slow_init(): requests under the
+ * threshold only pay for the comparison (a clock going backwards wraps
+ * around and reads as slow, hence the check after it). Slow ones are
+ * offered to the reservoir of the worker; if the chosen slot is being
+ * written by another core, the sample is dropped rather than waited for.
+ */
+extern "C" void stats_pusher_mongodb_slow_after_request(struct wsgi_request *wsgi_req) {
+    if (wsgi_req->end_of_request - wsgi_req->start_of_request < slow_threshold_us) {
+        return;
+    }
+    if (wsgi_req->end_of_request < wsgi_req->start_of_request ||
+            uwsgi.mywid <= 0 || uwsgi.mywid >= slow_count) {
+        return;
+    }
+
+    static __thread unsigned int seed = 0;
+    if (!seed) seed = (unsigned int)(uwsgi_micros() ^ ((uint64_t)uwsgi.mywid << 16) ^ wsgi_req->async_id);
+
+    struct slow_ring *ring = slow_ring_of(uwsgi.mywid);
+    uint64_t state = __atomic_fetch_add(&ring->state, 1, __ATOMIC_RELAXED);
+    uint64_t n = (uint32_t)state + 1;
+    uint64_t slot = n - 1;
+    if (n > (uint64_t)slow_size) {
+        slot = (((uint64_t)rand_r(&seed) << 31) ^ (uint64_t)rand_r(&seed)) % n;
+        if (slot >= (uint64_t)slow_size) return;
+    }
+
+    struct slow_sample *s = &ring->samples[slot];
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    s->status = wsgi_req->status;
+    s->core = wsgi_req->async_id;
+    s->period = (uint32_t)(state >> 32);
+    s->duration_us = wsgi_req->end_of_request - wsgi_req->start_of_request;
+    s->time_ms = wsgi_req->end_of_request / 1000;
+    copy_field(s->method, sizeof(s->method), wsgi_req->method, wsgi_req->method_len);
+    copy_field(s->path, sizeof(s->path), wsgi_req->path_info, wsgi_req->path_info_len);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocates a reservoir of 'size' samples per worker in shared memory and
+ * registers the after_request hook. Must run in the master before the
+ * workers fork.
+ */
+void slow_init(int threshold_ms, int size) {
+    struct uwsgi_string_list *usl;
+
+    slow_threshold_us = (uint64_t)threshold_ms * 1000;
+    slow_size = size;
+    slow_count = uwsgi.numproc + 1;
+    slow_rings = (char *)uwsgi_calloc_shared(slow_count *
+        (sizeof(struct slow_ring) + slow_size * sizeof(struct slow_sample)));
+    // Periods start at 1, so that no slot is from the current one before
+    // it is written
+    for (int w = 1; w < slow_count; w++) {
+        slow_ring_of(w)->state = (uint64_t)1 << 32;
+    }
+
+    usl = uwsgi_string_new_list(&uwsgi.after_request_hooks,
+        (char *)"stats_pusher_mongodb_slow_after_request");
+    usl->custom_ptr = (void *)stats_pusher_mongodb_slow_after_request;
+}
+
+/**
+ * Drains the reservoirs: returns the sampled slow requests since the
+ * previous push, e.g.
+ *
+ *     [{"worker": 3, "core": 0, "method": "GET", "path": "/report",
+ *       "status": 200, "duration_us": 2403117, "time_ms": 1700000000123}]
+ *
+ * and sets 'seen' to the number of slow requests they were sampled from.
+ * Each reservoir is moved to the next period and reset in a single atomic
+ * operation; only samples stamped with the period being drained are
+ * reported. Samples overwritten while being read are left out, as are
+ * slots still being written, or already rewritten in the next period.
+ */
+json slow_drain(uint64_t *seen) {
+    json out = json::array();
+
+    *seen = 0;
+    if (!slow_rings) {
+        return out;
+    }
+    for (int w = 1; w < slow_count; w++) {
+        struct slow_ring *ring = slow_ring_of(w);
+        uint64_t state = __atomic_load_n(&ring->state, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ring->state, &state,
+                ((state >> 32) + 1) << 32, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        }
+        uint32_t period = (uint32_t)(state >> 32);
+        uint64_t n = (uint32_t)state;
+        *seen += n;
+        for (uint64_t i = 0; i < std::min(n, (uint64_t)slow_size); i++) {
+            struct slow_sample *s = &ring->samples[i];
+            struct slow_sample copy;
+            uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) continue;
+            memcpy(&copy, s, sizeof(copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq || copy.period != period) {
+                continue;
+            }
+            copy.method[SLOW_METHOD_MAX - 1] = 0;
+            copy.path[SLOW_PATH_MAX - 1] = 0;
+            out.push_back({
+                {"worker", w},
+                {"core", copy.core},
+                {"method", copy.method},
+                {"path", copy.path},
+                {"status", copy.status},
+                {"duration_us", copy.duration_us},
+                {"time_ms", copy.time_ms},
+            });
+        }
+    }
+    return out;
+}
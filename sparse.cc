@@ -0,0 +1,193 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "json.hpp"
+#include "stats.h"
+
+// Kept in each summarized worker's place in "other_workers"
+static const int summed_fields[] = {
+    WORKER_REQUESTS, WORKER_DELTA_REQUESTS, WORKER_EXCEPTIONS, WORKER_HARAKIRI_COUNT,
+    WORKER_TX, WORKER_RSS, WORKER_VSZ, -1,
+};
+
+static bool is_default(const json &value) {
+    if (value.is_number()) return value == 0;
+    if (value.is_array() || value.is_object()) return value.empty();
+    return false;
+}
+
+// Removes the zero and empty leaves of a worker or core, keeping its id
+static void elide_defaults(json &obj) {
+    for (auto it = obj.begin(); it != obj.end();) {
+        if (it.key() != "id" && is_default(it.value())) {
+            it = obj.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Whether a json core has nothing left but its id
+static bool idle_core(const json &core) {
+    return core.size() <= 1 && (core.empty() || core.count("id"));
+}
+
+// Removes the idle cores of a json cores array, returning their indexes
+static json elide_cores(json::array_t &list) {
+    json idle = json::array();
+    json::array_t active;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].is_object()) {
+            elide_defaults(list[i]);
+            if (idle_core(list[i])) {
+                idle.push_back(i);
+                continue;
+            }
+        }
+        active.push_back(std::move(list[i]));
+    }
+    list.swap(active);
+    return idle;
+}
+
+// elide_defaults() for a typed worker, core or app
+static void elide_typed_defaults(stats_object &obj) {
+    const stats_schema *schema = obj.schema;
+    for (int i = 1; i < schema->count; i++) {
+        if (!(obj.present & (1u << i))) continue;
+        const stats_field *field = &schema->fields[i];
+        bool is_default = false;
+        switch (field->kind) {
+        case FIELD_INT:
+            is_default = obj.ints[i] == 0;
+            break;
+        case FIELD_STRING:
+            break;
+        case FIELD_OBJECTS:
+            is_default = obj.children[field->slot].empty();
+            break;
+        case FIELD_EMPTY_ARRAY:
+        case FIELD_EMPTY_OBJECT:
+            is_default = true;
+            break;
+        }
+        if (is_default) obj.present &= ~(1u << i);
+    }
+    if (obj.extra.is_object()) {
+        elide_defaults(obj.extra);
+    }
+}
+
+static void sparse_worker(stats_object &worker) {
+    json idle = json::array();
+    if (auto *list = stats_objects(worker, WORKER_CORES)) {
+        std::vector<stats_object> active;
+        for (size_t i = 0; i < list->size(); i++) {
+            stats_object &core = (*list)[i];
+            elide_typed_defaults(core);
+            size_t keys = __builtin_popcount(core.present) + core.extra.size();
+            if (keys <= 1 && (!keys || stats_has(core, CORE_ID))) {
+                idle.push_back(i);
+                continue;
+            }
+            active.push_back(std::move(core));
+        }
+        list->swap(active);
+    } else if (worker.extra.is_object()) {
+        auto cores = worker.extra.find("cores");
+        if (cores != worker.extra.end() && cores->is_array()) {
+            idle = elide_cores(cores->get_ref<json::array_t &>());
+        }
+    }
+    if (!idle.empty()) {
+        stats_set_extra(worker, "idle_cores", std::move(idle));
+    }
+    elide_typed_defaults(worker);
+}
+
+// The sparse form of a "workers" array holding something else than
+// objects, which is not typed
+static void sparse_json_workers(json &workers) {
+    for (auto &worker : workers) {
+        if (!worker.is_object()) continue;
+        auto cores = worker.find("cores");
+        if (cores != worker.end() && cores->is_array()) {
+            json idle = elide_cores(cores->get_ref<json::array_t &>());
+            if (!idle.empty()) {
+                worker["idle_cores"] = std::move(idle);
+            }
+        }
+        elide_defaults(worker);
+    }
+}
+
+/**
+ * Rewrites the stats document in sparse form, so that its size follows
+ * activity rather than the number of workers and cores configured:
+ *
+ * - zero numbers and empty arrays or objects are left out of workers and
+ *   cores, except for their "id";
+ * - cores left with nothing but their id are removed from "cores", and
+ *   their index in the array is listed in the worker's "idle_cores";
+ * - with top_k > 0 instead, only the top_k workers with the most requests
+ *   since the previous push (delta_requests) stay in "workers", in full
+ *   detail; the others are replaced by "other_workers", holding their
+ *   "ids" and the sums of their requests, delta_requests, exceptions,
+ *   harakiri_count, tx, rss and vsz.
+ *
+ * The document gets "sparse": true. Readers rebuild a worker or core by
+ * defaulting missing keys to 0 ([] for "apps", "cores" and "vars", {}
+ * for "req_info"), and the cores array by inserting {"id": i} at each
+ * index i of "idle_cores", in increasing order; summarized workers are
+ * only known in total.
+ */
+void sparse_workers(stats_snapshot &snap, int top_k) {
+    json &doc = snap.doc;
+    if (!snap.typed) {
+        auto workers = doc.find("workers");
+        if (workers == doc.end() || !workers->is_array()) {
+            return;
+        }
+        doc["sparse"] = true;
+        if (top_k <= 0) {
+            sparse_json_workers(*workers);
+        }
+        return;
+    }
+    doc["sparse"] = true;
+
+    std::vector<stats_object> &list = snap.workers;
+    if (top_k > 0) {
+        if (list.size() <= (size_t)top_k) {
+            return;
+        }
+        std::stable_sort(list.begin(), list.end(), [](const stats_object &a, const stats_object &b) {
+            return stats_uint(a, WORKER_DELTA_REQUESTS) > stats_uint(b, WORKER_DELTA_REQUESTS);
+        });
+
+        json ids = json::array();
+        uint64_t sums[sizeof(summed_fields) / sizeof(summed_fields[0])] = {0};
+        for (auto it = list.begin() + top_k; it != list.end(); ++it) {
+            ids.push_back(stats_int(*it, WORKER_ID));
+            for (int i = 0; summed_fields[i] >= 0; i++) {
+                sums[i] += stats_uint(*it, summed_fields[i]);
+            }
+        }
+        json other = {{"ids", std::move(ids)}};
+        for (int i = 0; summed_fields[i] >= 0; i++) {
+            other[stats_schemas[SCHEMA_WORKER].fields[summed_fields[i]].name] = sums[i];
+        }
+        list.erase(list.begin() + top_k, list.end());
+        // Back in worker id order, as uWSGI lists them
+        std::sort(list.begin(), list.end(), [](const stats_object &a, const stats_object &b) {
+            return stats_int(a, WORKER_ID) < stats_int(b, WORKER_ID);
+        });
+        doc["other_workers"] = std::move(other);
+        return;
+    }
+
+    for (auto &worker : list) {
+        sparse_worker(worker);
+    }
+}
@@ -0,0 +1,506 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "json.hpp"
+#include "fnv.h"
+#include "stats.h"
+
+#define INT(name) {name, sizeof(name) - 1, fnv1a_64_str(name), FIELD_INT, 0, SCHEMA_COUNT}
+#define STR(name, slot) {name, sizeof(name) - 1, fnv1a_64_str(name), FIELD_STRING, slot, SCHEMA_COUNT}
+#define OBJECTS(name, slot, schema) \
+    {name, sizeof(name) - 1, fnv1a_64_str(name), FIELD_OBJECTS, slot, schema}
+#define EMPTY_ARRAY(name) \
+    {name, sizeof(name) - 1, fnv1a_64_str(name), FIELD_EMPTY_ARRAY, 0, SCHEMA_COUNT}
+#define EMPTY_OBJECT(name) \
+    {name, sizeof(name) - 1, fnv1a_64_str(name), FIELD_EMPTY_OBJECT, 0, SCHEMA_COUNT}
+
+// In the order of the field enums of stats.h
+static const stats_field worker_fields[] = {
+    INT("id"), INT("pid"), INT("accepting"), INT("requests"), INT("delta_requests"),
+    INT("exceptions"), INT("harakiri_count"), INT("signals"), INT("signal_queue"),
+    STR("status", 0), INT("rss"), INT("vsz"), INT("running_time"), INT("last_spawn"),
+    INT("respawn_count"), INT("tx"), INT("avg_rt"),
+    OBJECTS("apps", 0, SCHEMA_APP), OBJECTS("cores", 1, SCHEMA_CORE),
+    INT("failed_requests"), INT("respawns"), INT("avg_response_time"), INT("total_tx"),
+    INT("rss_size"), INT("vsz_size"),
+};
+
+static const stats_field core_fields[] = {
+    INT("id"), INT("requests"), INT("static_requests"), INT("routed_requests"),
+    INT("offloaded_requests"), INT("write_errors"), INT("read_errors"), INT("in_request"),
+    EMPTY_ARRAY("vars"), EMPTY_OBJECT("req_info"), INT("exceptions"),
+};
+
+static const stats_field app_fields[] = {
+    INT("id"), INT("modifier1"), STR("mountpoint", 0), INT("startup_time"), INT("requests"),
+    INT("exceptions"), STR("chdir", 1),
+};
+
+#undef INT
+#undef STR
+#undef OBJECTS
+#undef EMPTY_ARRAY
+#undef EMPTY_OBJECT
+
+static_assert(sizeof(worker_fields) / sizeof(worker_fields[0]) == WORKER_FIELDS,
+    "worker_fields must match enum worker_field");
+static_assert(sizeof(core_fields) / sizeof(core_fields[0]) == CORE_FIELDS,
+    "core_fields must match enum core_field");
+static_assert(sizeof(app_fields) / sizeof(app_fields[0]) == APP_FIELDS,
+    "app_fields must match enum app_field");
+static_assert(WORKER_FIELDS <= STATS_MAX_FIELDS, "too many worker fields");
+
+stats_schema stats_schemas[SCHEMA_COUNT];
+
+static void build_schema(stats_schema_id id, const stats_field *fields, int count) {
+    stats_schema &schema = stats_schemas[id];
+    schema.fields = fields;
+    schema.count = count;
+
+    for (int i = 0; i < count; i++) {
+        schema.order[i] = i;
+    }
+    std::sort(schema.order, schema.order + count, [fields](uint8_t a, uint8_t b) {
+        return strcmp(fields[a].name, fields[b].name) < 0;
+    });
+
+    for (schema.size = count; schema.size <= 128; schema.size++) {
+        memset(schema.slots, 0, sizeof(schema.slots));
+        int i;
+        for (i = 0; i < count; i++) {
+            const stats_field **slot = &schema.slots[fields[i].hash % schema.size];
+            if (*slot) break;
+            *slot = &fields[i];
+        }
+        if (i == count) return;
+    }
+    uwsgi_log("[stats-pusher-mongodb] no lookup table for the stats schema %d\n", id);
+    exit(1);
+}
+
+static bool build_schemas() {
+    build_schema(SCHEMA_WORKER, worker_fields, WORKER_FIELDS);
+    build_schema(SCHEMA_CORE, core_fields, CORE_FIELDS);
+    build_schema(SCHEMA_APP, app_fields, APP_FIELDS);
+    return true;
+}
+
+static bool schemas_built = build_schemas();
+
+const stats_field *stats_find_field(const stats_schema *schema, const char *key, size_t len) {
+    const stats_field *field = schema->slots[fnv1a_64(key, len) % schema->size];
+    if (field && field->len == len && !memcmp(field->name, key, len)) return field;
+    return NULL;
+}
+
+/**
+ * Holds a value in the slot of its field, if it has the type of the
+ * field, replacing any value the key had. Returns false, leaving the
+ * object as it is, otherwise.
+ */
+bool stats_set_field(stats_object &obj, const stats_field *field, json &value) {
+    int i = field - obj.schema->fields;
+    uint32_t bit = 1u << i;
+
+    switch (field->kind) {
+    case FIELD_INT:
+        if (value.is_number_unsigned()) {
+            obj.ints[i] = value.get<uint64_t>();
+            obj.negative &= ~bit;
+        } else if (value.is_number_integer()) {
+            int64_t v = value.get<int64_t>();
+            obj.ints[i] = (uint64_t)v;
+            if (v < 0) {
+                obj.negative |= bit;
+            } else {
+                obj.negative &= ~bit;
+            }
+        } else {
+            return false;
+        }
+        break;
+    case FIELD_STRING:
+        if (!value.is_string()) return false;
+        obj.strings[field->slot] = std::move(value.get_ref<std::string &>());
+        break;
+    case FIELD_OBJECTS: {
+        if (!value.is_array()) return false;
+        for (auto &element : value) {
+            if (!element.is_object()) return false;
+        }
+        std::vector<stats_object> list;
+        list.reserve(value.size());
+        for (auto &element : value) {
+            list.push_back(stats_object_from_json(&stats_schemas[field->child], element));
+        }
+        obj.children[field->slot].swap(list);
+        break;
+    }
+    case FIELD_EMPTY_ARRAY:
+        if (!value.is_array() || !value.empty()) return false;
+        break;
+    case FIELD_EMPTY_OBJECT:
+        if (!value.is_object() || !value.empty()) return false;
+        break;
+    }
+    obj.present |= bit;
+    if (obj.extra.is_object()) {
+        obj.extra.erase(field->name);
+    }
+    return true;
+}
+
+// Sets a key outside of the field slots, replacing any value it had
+void stats_set_extra(stats_object &obj, const std::string &key, json value) {
+    const stats_field *field = stats_find_field(obj.schema, key.data(), key.size());
+    if (field) {
+        obj.present &= ~(1u << (field - obj.schema->fields));
+    }
+    if (!obj.extra.is_object()) {
+        obj.extra = json::object();
+    }
+    obj.extra[key] = std::move(value);
+}
+
+stats_object stats_object_from_json(const stats_schema *schema, json &obj) {
+    stats_object out(schema);
+    for (auto it = obj.begin(); it != obj.end(); ++it) {
+        const std::string &key = it.key();
+        const stats_field *field = stats_find_field(schema, key.data(), key.size());
+        if (!field || !stats_set_field(out, field, it.value())) {
+            if (!out.extra.is_object()) {
+                out.extra = json::object();
+            }
+            out.extra[key] = std::move(it.value());
+        }
+    }
+    return out;
+}
+
+static json field_json(const stats_object &obj, const stats_field *field) {
+    int i = field - obj.schema->fields;
+
+    switch (field->kind) {
+    case FIELD_INT:
+        if (obj.negative & (1u << i)) return (int64_t)obj.ints[i];
+        return obj.ints[i];
+    case FIELD_STRING:
+        return obj.strings[field->slot];
+    case FIELD_OBJECTS: {
+        json list = json::array();
+        for (auto &child : obj.children[field->slot]) {
+            list.push_back(stats_object_to_json(child));
+        }
+        return list;
+    }
+    case FIELD_EMPTY_ARRAY:
+        return json::array();
+    case FIELD_EMPTY_OBJECT:
+        return json::object();
+    }
+    return nullptr;
+}
+
+json stats_object_to_json(const stats_object &obj) {
+    json out = obj.extra.is_object() ? obj.extra : json::object();
+    for (int i = 0; i < obj.schema->count; i++) {
+        if (obj.present & (1u << i)) {
+            out[obj.schema->fields[i].name] = field_json(obj, &obj.schema->fields[i]);
+        }
+    }
+    return out;
+}
+
+static json workers_json(const stats_snapshot &snap) {
+    json list = json::array();
+    for (auto &worker : snap.workers) {
+        list.push_back(stats_object_to_json(worker));
+    }
+    return list;
+}
+
+// Types the "workers" of the document, if it is an array of objects
+static void type_workers(stats_snapshot &snap) {
+    if (!snap.doc.is_object()) return;
+    auto it = snap.doc.find("workers");
+    if (it == snap.doc.end() || !it->is_array()) return;
+    for (auto &worker : *it) {
+        if (!worker.is_object()) return;
+    }
+    snap.workers.clear();
+    snap.workers.reserve(it->size());
+    for (auto &worker : *it) {
+        snap.workers.push_back(stats_object_from_json(&stats_schemas[SCHEMA_WORKER], worker));
+    }
+    snap.doc.erase(it);
+    snap.typed = true;
+}
+
+// Puts the typed workers back into the document as json
+static void untype_workers(stats_snapshot &snap) {
+    if (!snap.typed) return;
+    snap.doc["workers"] = workers_json(snap);
+    snap.workers.clear();
+    snap.typed = false;
+}
+
+stats_snapshot stats_from_json(json doc) {
+    stats_snapshot snap;
+    snap.doc = std::move(doc);
+    type_workers(snap);
+    return snap;
+}
+
+json stats_to_json(const stats_snapshot &snap) {
+    json doc = snap.doc;
+    if (snap.typed) {
+        doc["workers"] = workers_json(snap);
+    }
+    return doc;
+}
+
+/**
+ * The workers of a snapshot as typed objects: its own, or, for the rare
+ * "workers" arrays holding something else than objects, those of the
+ * objects it holds, decoded into 'scratch'.
+ */
+const std::vector<stats_object> &stats_workers(const stats_snapshot &snap,
+        std::vector<stats_object> &scratch) {
+    scratch.clear();
+    if (snap.typed) return snap.workers;
+    if (!snap.doc.is_object()) return scratch;
+    auto it = snap.doc.find("workers");
+    if (it == snap.doc.end() || !it->is_array()) return scratch;
+    for (auto &worker : *it) {
+        if (worker.is_object()) {
+            json copy = worker;
+            scratch.push_back(stats_object_from_json(&stats_schemas[SCHEMA_WORKER], copy));
+        }
+    }
+    return scratch;
+}
+
+stats_path stats_path_of(const std::string &pointer) {
+    stats_path path;
+    path.ptr = json::json_pointer(pointer);
+
+    std::string::size_type start = 1;
+    while (start <= pointer.size() && !pointer.empty()) {
+        std::string::size_type slash = pointer.find('/', start);
+        if (slash == std::string::npos) slash = pointer.size();
+        std::string token = pointer.substr(start, slash - start);
+        std::string::size_type tilde = 0;
+        while ((tilde = token.find('~', tilde)) != std::string::npos) {
+            token.replace(tilde, 2, token[tilde + 1] == '1' ? "/" : "~");
+            tilde++;
+        }
+        path.tokens.push_back(token);
+        start = slash + 1;
+    }
+    return path;
+}
+
+// The pointer of the tokens from 'first' on
+static json::json_pointer pointer_of(const std::vector<std::string> &tokens, size_t first) {
+    std::string pointer;
+    for (size_t i = first; i < tokens.size(); i++) {
+        pointer += '/';
+        for (char c : tokens[i]) {
+            if (c == '~') {
+                pointer += "~0";
+            } else if (c == '/') {
+                pointer += "~1";
+            } else {
+                pointer += c;
+            }
+        }
+    }
+    return json::json_pointer(pointer);
+}
+
+/**
+ * Reads an array index token, as json pointers do: digits without a
+ * leading zero, or "-" for the end of an array of 'size' elements.
+ */
+static bool array_index(const std::string &token, size_t size, size_t &index) {
+    if (token == "-") {
+        index = size;
+        return true;
+    }
+    if (token.empty() || token.size() > 9 || (token.size() > 1 && token[0] == '0')) {
+        return false;
+    }
+    index = 0;
+    for (char c : token) {
+        if (c < '0' || c > '9') return false;
+        index = index * 10 + (c - '0');
+    }
+    return true;
+}
+
+/**
+ * Whether json turns a null it walks through with this token into an
+ * array rather than an object.
+ */
+static bool makes_array(const std::string &token) {
+    return token == "-" || token.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// Whether the element at tokens[pos] is one a typed array can take
+static bool typed_element(const std::vector<std::string> &tokens, size_t pos, size_t size,
+        const json &value, size_t &index) {
+    if (!array_index(tokens[pos], size, index)) return false;
+    if (pos + 1 == tokens.size()) return value.is_object();
+    // A new element walked through is an object, unless json makes it an array
+    return index < size || !makes_array(tokens[pos + 1]);
+}
+
+static void object_set(stats_object &obj, const std::vector<std::string> &tokens, size_t pos,
+        json &value) {
+    const std::string &key = tokens[pos];
+    const stats_field *field = stats_find_field(obj.schema, key.data(), key.size());
+
+    if (pos + 1 == tokens.size()) {
+        if (!field || !stats_set_field(obj, field, value)) {
+            stats_set_extra(obj, key, std::move(value));
+        }
+        return;
+    }
+
+    uint32_t bit = field ? 1u << (field - obj.schema->fields) : 0;
+    size_t i;
+    if (field && field->kind == FIELD_OBJECTS && (obj.present & bit) &&
+            typed_element(tokens, pos + 1, obj.children[field->slot].size(), value, i)) {
+        std::vector<stats_object> &list = obj.children[field->slot];
+        const stats_schema *schema = &stats_schemas[field->child];
+        if (i >= list.size()) {
+            list.resize(i + 1, stats_object(schema));
+        }
+        if (pos + 2 < tokens.size()) {
+            object_set(list[i], tokens, pos + 2, value);
+        } else {
+            list[i] = stats_object_from_json(schema, value);
+        }
+        return;
+    }
+
+    // Anything else goes through the json of the key
+    if (field && (obj.present & bit)) {
+        stats_set_extra(obj, key, field_json(obj, field));
+    } else if (!obj.extra.is_object()) {
+        obj.extra = json::object();
+    }
+    obj.extra[key][pointer_of(tokens, pos + 1)] = std::move(value);
+}
+
+/**
+ * Sets the value at a path of the snapshot, as json's operator[] does
+ * with the pointer on the document it stands for, creating what is
+ * missing on the way, and throwing the same exceptions. One difference:
+ * workers, cores and apps added past the end of their array are typed
+ * objects, where json would fill the gap with nulls.
+ */
+void stats_set(stats_snapshot &snap, const stats_path &path, json value) {
+    const std::vector<std::string> &tokens = path.tokens;
+
+    if (tokens.empty()) {
+        snap = stats_from_json(std::move(value));
+        return;
+    }
+    if (!snap.typed || tokens[0] != "workers") {
+        snap.doc[path.ptr] = std::move(value);
+        if (!snap.typed && tokens[0] == "workers") {
+            type_workers(snap);
+        }
+        return;
+    }
+    if (tokens.size() == 1) {
+        snap.workers.clear();
+        snap.typed = false;
+        snap.doc["workers"] = std::move(value);
+        type_workers(snap);
+        return;
+    }
+
+    size_t i;
+    if (typed_element(tokens, 1, snap.workers.size(), value, i)) {
+        const stats_schema *schema = &stats_schemas[SCHEMA_WORKER];
+        if (i >= snap.workers.size()) {
+            snap.workers.resize(i + 1, stats_object(schema));
+        }
+        if (tokens.size() == 2) {
+            snap.workers[i] = stats_object_from_json(schema, value);
+        } else {
+            object_set(snap.workers[i], tokens, 2, value);
+        }
+        return;
+    }
+    untype_workers(snap);
+    snap.doc[path.ptr] = std::move(value);
+}
+
+// The value at a path of the snapshot, throwing as json's at() does
+json stats_at(const stats_snapshot &snap, const stats_path &path) {
+    if (snap.typed && !path.tokens.empty() && path.tokens[0] == "workers") {
+        json doc = {{"workers", workers_json(snap)}};
+        return doc.at(path.ptr);
+    }
+    return snap.doc.at(path.ptr);
+}
+
+// The json of a field held in 'extra', or NULL
+const json *stats_extra(const stats_object &obj, int field) {
+    if (!obj.extra.is_object()) return NULL;
+    auto it = obj.extra.find(obj.schema->fields[field].name);
+    return it != obj.extra.end() ? &*it : NULL;
+}
+
+// Whether the object has the key of a field, whatever its value
+bool stats_has(const stats_object &obj, int field) {
+    return (obj.present & (1u << field)) || stats_extra(obj, field);
+}
+
+/**
+ * The value of a numeric field, converted as json's get() does, whether
+ * it is held in its slot or in 'extra' (e.g. a float), or 'def' when the
+ * object does not have it or it is not a number.
+ */
+uint64_t stats_uint(const stats_object &obj, int field, uint64_t def) {
+    if (obj.present & (1u << field)) {
+        return obj.schema->fields[field].kind == FIELD_INT ? obj.ints[field] : def;
+    }
+    const json *value = stats_extra(obj, field);
+    return value && value->is_number() ? value->get<uint64_t>() : def;
+}
+
+int64_t stats_int(const stats_object &obj, int field, int64_t def) {
+    if (obj.present & (1u << field)) {
+        return obj.schema->fields[field].kind == FIELD_INT ? (int64_t)obj.ints[field] : def;
+    }
+    const json *value = stats_extra(obj, field);
+    return value && value->is_number() ? value->get<int64_t>() : def;
+}
+
+double stats_double(const stats_object &obj, int field, double def) {
+    if (obj.present & (1u << field)) {
+        if (obj.schema->fields[field].kind != FIELD_INT) return def;
+        if (obj.negative & (1u << field)) return (double)(int64_t)obj.ints[field];
+        return (double)obj.ints[field];
+    }
+    const json *value = stats_extra(obj, field);
+    return value && value->is_number() ? value->get<double>() : def;
+}
+
+// The typed objects of an array field, or NULL when it is not held typed
+const std::vector<stats_object> *stats_objects(const stats_object &obj, int field) {
+    const stats_field *f = &obj.schema->fields[field];
+    if (f->kind != FIELD_OBJECTS || !(obj.present & (1u << field))) return NULL;
+    return &obj.children[f->slot];
+}
+
+std::vector<stats_object> *stats_objects(stats_object &obj, int field) {
+    return const_cast<std::vector<stats_object> *>(
+        stats_objects(static_cast<const stats_object &>(obj), field));
+}
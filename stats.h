@@ -0,0 +1,152 @@
+#ifndef STATS_PUSHER_MONGODB_STATS_H
+#define STATS_PUSHER_MONGODB_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+/**
+ * The stats snapshot of a push.
+ *
+ * Workers make up nearly all of the uWSGI stats document: with their
+ * cores, hundreds of thousands of values on a large instance. Rather than
+ * a json tree, they are decoded into typed objects, where each known key
+ * of a worker, core or app has a slot of its own; whatever else an object
+ * holds (keys set by metrics or custom keys, or known keys with a value
+ * of an unexpected type) stays in its 'extra' json object. Everything
+ * else in the document is plain json.
+ *
+ * The document a snapshot stands for is 'doc' with, when 'typed' is set,
+ * a "workers" array of the typed workers (see stats_to_json()). While
+ * 'typed' is set, 'doc' has no "workers" key.
+ */
+
+#define STATS_MAX_FIELDS 32
+#define STATS_MAX_STRINGS 2
+#define STATS_MAX_CHILDREN 2
+
+enum stats_field_kind {
+    FIELD_INT,          // an integer, in ints[]
+    FIELD_STRING,       // a string, in strings[]
+    FIELD_OBJECTS,      // an array of objects of the child schema, in children[]
+    FIELD_EMPTY_ARRAY,  // [], as "vars" outside of a request
+    FIELD_EMPTY_OBJECT, // {}, as "req_info" outside of a request
+};
+
+enum stats_schema_id {
+    SCHEMA_WORKER, SCHEMA_CORE, SCHEMA_APP, SCHEMA_COUNT,
+};
+
+// Field indexes, in the order uWSGI writes the keys, then those metrics add
+enum worker_field {
+    WORKER_ID, WORKER_PID, WORKER_ACCEPTING, WORKER_REQUESTS, WORKER_DELTA_REQUESTS,
+    WORKER_EXCEPTIONS, WORKER_HARAKIRI_COUNT, WORKER_SIGNALS, WORKER_SIGNAL_QUEUE,
+    WORKER_STATUS, WORKER_RSS, WORKER_VSZ, WORKER_RUNNING_TIME, WORKER_LAST_SPAWN,
+    WORKER_RESPAWN_COUNT, WORKER_TX, WORKER_AVG_RT, WORKER_APPS, WORKER_CORES,
+    WORKER_FAILED_REQUESTS, WORKER_RESPAWNS, WORKER_AVG_RESPONSE_TIME, WORKER_TOTAL_TX,
+    WORKER_RSS_SIZE, WORKER_VSZ_SIZE,
+    WORKER_FIELDS,
+};
+
+enum core_field {
+    CORE_ID, CORE_REQUESTS, CORE_STATIC_REQUESTS, CORE_ROUTED_REQUESTS,
+    CORE_OFFLOADED_REQUESTS, CORE_WRITE_ERRORS, CORE_READ_ERRORS, CORE_IN_REQUEST,
+    CORE_VARS, CORE_REQ_INFO, CORE_EXCEPTIONS,
+    CORE_FIELDS,
+};
+
+enum app_field {
+    APP_ID, APP_MODIFIER1, APP_MOUNTPOINT, APP_STARTUP_TIME, APP_REQUESTS, APP_EXCEPTIONS,
+    APP_CHDIR,
+    APP_FIELDS,
+};
+
+struct stats_schema;
+
+/**
+ * A known key of a typed object. 'slot' indexes strings[] or children[]
+ * for the fields held there; integers are held at the field index.
+ */
+struct stats_field {
+    const char *name;
+    size_t len;
+    uint64_t hash;
+    stats_field_kind kind;
+    int slot;
+    stats_schema_id child;
+};
+
+/**
+ * The fields of a typed object, with their order by name (the order json
+ * objects, hence the BSON conversion, keep keys in) and a lookup table
+ * indexed by the key hash modulo its size, which is the smallest one that
+ * leaves every field in a slot of its own.
+ */
+struct stats_schema {
+    const stats_field *fields;
+    int count;
+    uint8_t order[STATS_MAX_FIELDS];
+    const stats_field *slots[128];
+    uint64_t size;
+};
+
+extern stats_schema stats_schemas[SCHEMA_COUNT];
+
+struct stats_object {
+    const stats_schema *schema;
+    uint32_t present;   // fields held in their slot
+    uint32_t negative;  // integer fields holding a negative int64
+    uint64_t ints[STATS_MAX_FIELDS];
+    std::string strings[STATS_MAX_STRINGS];
+    std::vector<stats_object> children[STATS_MAX_CHILDREN];
+    json extra;         // an object with the other keys, or null
+
+    explicit stats_object(const stats_schema *schema = NULL)
+        : schema(schema), present(0), negative(0), ints() {}
+};
+
+struct stats_snapshot {
+    json doc;
+    bool typed;
+    std::vector<stats_object> workers;
+
+    stats_snapshot() : typed(false) {}
+};
+
+/**
+ * A JSON pointer into a snapshot, split into its reference tokens.
+ * stats_path_of() throws as json::json_pointer does on invalid pointers.
+ */
+struct stats_path {
+    json::json_pointer ptr;
+    std::vector<std::string> tokens;
+};
+
+const stats_field *stats_find_field(const stats_schema *schema, const char *key, size_t len);
+bool stats_set_field(stats_object &obj, const stats_field *field, json &value);
+void stats_set_extra(stats_object &obj, const std::string &key, json value);
+stats_object stats_object_from_json(const stats_schema *schema, json &obj);
+json stats_object_to_json(const stats_object &obj);
+stats_snapshot stats_from_json(json doc);
+json stats_to_json(const stats_snapshot &snap);
+
+const std::vector<stats_object> &stats_workers(const stats_snapshot &snap,
+    std::vector<stats_object> &scratch);
+
+stats_path stats_path_of(const std::string &pointer);
+void stats_set(stats_snapshot &snap, const stats_path &path, json value);
+json stats_at(const stats_snapshot &snap, const stats_path &path);
+
+bool stats_has(const stats_object &obj, int field);
+uint64_t stats_uint(const stats_object &obj, int field, uint64_t def = 0);
+int64_t stats_int(const stats_object &obj, int field, int64_t def = 0);
+double stats_double(const stats_object &obj, int field, double def = 0);
+const json *stats_extra(const stats_object &obj, int field);
+const std::vector<stats_object> *stats_objects(const stats_object &obj, int field);
+std::vector<stats_object> *stats_objects(stats_object &obj, int field);
+
+#endif
@@ -0,0 +1,107 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include "json.hpp"
+#include "stats.h"
+
+bool counter_since_push(int64_t id, const char *key, uint64_t *delta);
+
+/**
+ * The per-worker values summarized, one column per field, so that each
+ * summary is a loop over a contiguous array.
+ */
+struct worker_columns {
+    std::vector<double> avg_rt;
+    std::vector<double> rss;
+    std::vector<double> vsz;
+    std::vector<double> requests;
+    std::vector<double> busy;
+};
+
+// Nearest-rank percentile of a sorted column
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t rank = (size_t)(p * sorted.size() + 0.999999);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static json summarize(std::vector<double> &column) {
+    size_t n = column.size();
+    std::sort(column.begin(), column.end());
+    return {
+        {"min", column[0]},
+        {"max", column[n - 1]},
+        {"mean", std::accumulate(column.begin(), column.end(), 0.0) / n},
+        {"p50", percentile(column, 0.50)},
+        {"p95", percentile(column, 0.95)},
+        {"p99", percentile(column, 0.99)},
+    };
+}
+
+/**
+ * Returns the summary of the workers of a stats snapshot: min, max, mean
+ * and the 50th, 95th and 99th percentiles across workers of avg_rt, rss,
+ * vsz, the requests served since the previous push, and the busy
+ * fraction (the share of a worker's cores in a request), e.g.
+ *
+ *     {
+ *         "workers": 8,
+ *         "avg_rt": {"min": 812, "max": 3190, "mean": 1544.5,
+ *                    "p50": 1390, "p95": 3190, "p99": 3190},
+ *         ...
+ *     }
+ *
+ * The requests since the previous push come from the worker counters
+ * recorded by counter_snapshot(), which must have seen this snapshot.
+ * Workers the previous snapshot did not have are left out of them, and
+ * "requests" is left out on the first push.
+ */
+json worker_summary(const stats_snapshot &snap) {
+    worker_columns columns;
+    std::vector<stats_object> scratch;
+
+    for (auto &worker : stats_workers(snap, scratch)) {
+        int64_t id = stats_int(worker, WORKER_ID);
+
+        double cores = 0, busy = 0;
+        if (auto *list = stats_objects(worker, WORKER_CORES)) {
+            for (auto &core : *list) {
+                cores++;
+                if (stats_int(core, CORE_IN_REQUEST)) busy++;
+            }
+        } else if (const json *wc = stats_extra(worker, WORKER_CORES)) {
+            // Cores that are not all objects
+            if (wc->is_array()) {
+                for (auto &core : *wc) {
+                    cores++;
+                    if (core.is_object() && core.value("in_request", 0)) busy++;
+                }
+            }
+        }
+
+        columns.avg_rt.push_back(stats_double(worker, WORKER_AVG_RT));
+        columns.rss.push_back(stats_double(worker, WORKER_RSS));
+        columns.vsz.push_back(stats_double(worker, WORKER_VSZ));
+        uint64_t requests;
+        if (counter_since_push(id, "requests", &requests)) {
+            columns.requests.push_back((double)requests);
+        }
+        columns.busy.push_back(cores ? busy / cores : 0.0);
+    }
+
+    if (columns.avg_rt.empty()) {
+        return nullptr;
+    }
+    json summary = {
+        {"workers", columns.avg_rt.size()},
+        {"avg_rt", summarize(columns.avg_rt)},
+        {"rss", summarize(columns.rss)},
+        {"vsz", summarize(columns.vsz)},
+        {"busy", summarize(columns.busy)},
+    };
+    if (!columns.requests.empty()) {
+        summary["requests"] = summarize(columns.requests);
+    }
+    return summary;
+}
@@ -0,0 +1,83 @@
+#include <uwsgi.h>
+#include <string>
+#include <chrono>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+stats_snapshot parse_stats(const char *data, size_t len);
+
+/**
+ * A stats document shaped like the one uWSGI sends the pusher, with
+ * 'workers' workers of 'cores' cores each, pretty printed as uWSGI does.
+ */
+static std::string stats_fixture(int workers, int cores) {
+    json doc = {
+        {"version", "2.0.28"}, {"listen_queue", 0}, {"listen_queue_errors", 0},
+        {"signal_queue", 0}, {"load", 3}, {"pid", 4120}, {"uid", 33}, {"gid", 33},
+        {"cwd", "/srv/app"}, {"locks", json::array({{{"user 0", 0}}, {{"signal", 0}}})},
+        {"sockets", json::array({{{"name", "127.0.0.1:3031"}, {"proto", "uwsgi"},
+            {"queue", 0}, {"max_queue", 100}, {"shared", 0}, {"can_offload", 0}}})},
+    };
+    json list = json::array();
+    for (int w = 1; w <= workers; w++) {
+        json worker = {
+            {"id", w}, {"pid", 4120 + w}, {"accepting", 1}, {"requests", 1234567 + w},
+            {"delta_requests", 12}, {"exceptions", 3}, {"harakiri_count", 0},
+            {"signals", 0}, {"signal_queue", 0}, {"status", w % 3 ? "idle" : "busy"},
+            {"rss", 123456789012LL}, {"vsz", 523456789012LL}, {"running_time", 987654321},
+            {"last_spawn", 1700000000}, {"respawn_count", 1}, {"tx", 8812001234LL},
+            {"avg_rt", 12345}, {"apps", json::array({{{"id", 0}, {"modifier1", 0},
+                {"mountpoint", ""}, {"startup_time", 1}, {"requests", 1234567},
+                {"exceptions", 0}, {"chdir", "/srv/app"}}})},
+        };
+        json core_list = json::array();
+        for (int c = 0; c < cores; c++) {
+            core_list.push_back({{"id", c}, {"requests", 987654}, {"static_requests", 0},
+                {"routed_requests", 0}, {"offloaded_requests", 0}, {"write_errors", 0},
+                {"read_errors", 0}, {"in_request", c % 2}, {"vars", json::array()},
+                {"req_info", json::object()}});
+        }
+        worker["cores"] = core_list;
+        list.push_back(worker);
+    }
+    doc["workers"] = list;
+    return doc.dump(1, '\t');
+}
+
+template <typename F>
+static double best_ms(int runs, F parse) {
+    double best = 1e30;
+    for (int i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        parse();
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        if (ms < best) best = ms;
+    }
+    return best;
+}
+
+/**
+ * Compares parse_stats() with json::parse() on fixtures from a small to a
+ * very large instance, reporting the best of several runs of each.
+ */
+int main() {
+    static const struct {
+        int workers;
+        int cores;
+    } fixtures[] = {{4, 1}, {16, 4}, {64, 8}, {512, 16}};
+
+    for (auto &f : fixtures) {
+        std::string text = stats_fixture(f.workers, f.cores);
+        int runs = (int)(200000000 / (text.size() * 100)) + 5;
+        CHECK(stats_to_json(parse_stats(text.data(), text.size())) == json::parse(text));
+        double specialized = best_ms(runs, [&] { parse_stats(text.data(), text.size()); });
+        double generic = best_ms(runs, [&] { json::parse(text); });
+        printf("%4d workers x %2d cores, %8zu bytes: parse_stats %8.3f ms, "
+            "json::parse %8.3f ms, %.2fx\n", f.workers, f.cores, text.size(),
+            specialized, generic, generic / specialized);
+    }
+    fflush(stdout);
+    return test_result("bench_parse");
+}
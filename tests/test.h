@@ -0,0 +1,25 @@
+#ifndef STATS_PUSHER_MONGODB_TEST_H
+#define STATS_PUSHER_MONGODB_TEST_H
+
+#include <cstdio>
+
+/**
+ * Minimal checks for the plugin tests: a failed CHECK reports its location
+ * and the test keeps going, so a run lists every failure; main() returns
+ * test_result() as its exit status.
+ */
+extern int test_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+static inline int test_result(const char *name) {
+    fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "ok");
+    return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <uwsgi.h>
+#include <bson/bson.h>
+#include <string>
+#include <vector>
+#include <random>
+#include "test.h"
+
+// Included rather than linked, to see whether a push went through the
+// template
+#include "convert.cc"
+
+/**
+ * A stats document of 'workers' workers, with keys after "workers" so
+ * that the parallel conversion has to put them back in order. 'big'
+ * pushes integers out of int32 and 'wide' lengthens the strings, both of
+ * which change the BSON shape.
+ */
+static json stats_doc(std::mt19937_64 &rng, int workers, bool big, bool wide) {
+    json doc = {{"version", "2.0.28"}, {"pid", 4120}, {"load", (int)(rng() % 10)}};
+    for (int w = 1; w <= workers; w++) {
+        json worker = {
+            {"id", w}, {"requests", (uint64_t)(rng() % 100000)},
+            {"tx", big ? (uint64_t)(rng() % 1000) * 10000000000ULL : (uint64_t)(rng() % 1000000)},
+            {"status", rng() % 2 ? (wide ? "cheaped" : "idle") : (wide ? "stopped" : "busy")},
+            {"avg_rt", (int64_t)(rng() % 5000) - 10}, {"running", rng() % 2 == 0},
+            {"load", (double)(rng() % 1000) / 8}, {"signal", nullptr},
+            {"cores", {{{"id", 0}, {"in_request", (int)(rng() % 2)}, {"vars", json::array()}}}},
+        };
+        doc["workers"].push_back(worker);
+    }
+    doc["zz_after_workers"] = (uint64_t)(rng() % 100);
+    doc["metrics"] = {{"core.busy", (int)(rng() % 8)}};
+    return doc;
+}
+
+// The conversion must give exactly the BSON json::to_bson() gives, push
+// after push, whether the template was used or not
+static void check_push(const json &doc, int threads) {
+    std::vector<uint8_t> expected = json::to_bson(doc);
+    stats_snapshot snap = stats_from_json(doc);
+    bson_error_t error;
+
+    bson_t *bson = stats_to_bson(snap, threads, &error);
+    CHECK(bson != NULL);
+    if (!bson) return;
+    std::vector<uint8_t> got(bson_get_data(bson), bson_get_data(bson) + bson->len);
+    CHECK(got == expected);
+    // The snapshot itself is left as it was
+    CHECK(stats_to_json(snap) == doc);
+    bson_destroy(bson);
+}
+
+static void reset_template() {
+    if (tmpl.bson) bson_destroy(tmpl.bson);
+    tmpl.bson = NULL;
+    tmpl.shape = doc_shape();
+    tmpl.last = doc_shape();
+}
+
+// Documents BSON cannot hold fail with an error, the template or not
+static void check_error(const json &doc) {
+    stats_snapshot snap = stats_from_json(doc);
+    bson_error_t error;
+    for (int push = 0; push < 3; push++) {
+        error.message[0] = 0;
+        CHECK(stats_to_bson(snap, 1, &error) == NULL);
+        CHECK(error.message[0] != 0);
+    }
+}
+
+int main() {
+    std::mt19937_64 rng(42);
+
+    for (int threads : {1, 4}) {
+        for (int workers : {1, 3, 40}) {
+            // Same shape, new values: the template is compiled on the
+            // second push and patched from then on
+            reset_template();
+            for (int push = 0; push < 20; push++) {
+                json doc = stats_doc(rng, workers, false, false);
+                check_push(doc, threads);
+                CHECK((tmpl.bson != NULL) == (push >= 1));
+            }
+            // Shape changes in between: each one is still converted right
+            for (int push = 0; push < 20; push++) {
+                json doc = stats_doc(rng, workers + push % 2, push % 3 == 0, push % 5 == 0);
+                check_push(doc, threads);
+            }
+        }
+    }
+
+    // A shape changing on every push never gets a template
+    reset_template();
+    for (int push = 0; push < 10; push++) {
+        json doc = stats_doc(rng, 2, false, false);
+        doc["key" + std::to_string(push)] = push;
+        check_push(doc, 1);
+        CHECK(tmpl.bson == NULL);
+    }
+
+    // Workers typed or not, e.g. with a worker holding a core that is not
+    // an object, and known keys of unexpected types
+    reset_template();
+    for (int push = 0; push < 3; push++) {
+        json doc = stats_doc(rng, 40, false, false);
+        doc["workers"][3]["cores"].push_back(7);
+        doc["workers"][5]["requests"] = 1.5;
+        doc["workers"][6]["status"] = nullptr;
+        check_push(doc, 4);
+        doc["workers"].push_back("not a worker");
+        check_push(doc, 4);
+    }
+
+    check_error({{"workers", {{{"id", 1}, {"tx", 18446744073709551615ULL}}}}});
+    check_error({{"workers", {{{"id", 1}, {"x", 18446744073709551615ULL}}}}});
+    check_error({{"n", 9223372036854775808ULL}});
+    check_error({{std::string("a\0b", 3), 1}});
+    check_error(json::array({{{"workers", 1}}, 1, "x"}).at(1));
+    return test_result("test_convert");
+}
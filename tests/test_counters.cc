@@ -0,0 +1,81 @@
+#include <uwsgi.h>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+void counter_snapshot(const stats_snapshot &snap);
+bool counter_since_push(int64_t id, const char *key, uint64_t *delta);
+json counter_deltas();
+void counter_deltas_commit();
+
+static json stats(uint64_t requests1, uint64_t tx1, uint64_t requests2) {
+    return {{"workers", {
+        {{"id", 1}, {"requests", requests1}, {"exceptions", 0}, {"tx", tx1},
+            {"harakiri_count", 0}},
+        {{"id", 2}, {"requests", requests2}, {"exceptions", 1}, {"tx", 0},
+            {"harakiri_count", 0}},
+    }}};
+}
+
+// A push: the snapshot, then the $inc, committed if its write succeeded
+static json push(const json &doc, bool written) {
+    counter_snapshot(stats_from_json(doc));
+    json inc = counter_deltas();
+    if (written) counter_deltas_commit();
+    return inc;
+}
+
+// counter_since_push(), or -1 for a worker the previous push did not have
+static int64_t since_push(int64_t id) {
+    uint64_t delta;
+    return counter_since_push(id, "requests", &delta) ? (int64_t)delta : -1;
+}
+
+int main() {
+    // The first push only sets the baseline
+    CHECK(push(stats(100, 1000, 50), true) == json::object());
+    CHECK(since_push(1) == -1);
+
+    json inc = push(stats(110, 1500, 55), true);
+    CHECK(inc["requests"] == 15);
+    CHECK(inc["tx"] == 500);
+    CHECK(inc["exceptions"] == 0);
+    CHECK(inc["workers.1.requests"] == 10);
+    CHECK(inc["workers.2.requests"] == 5);
+    CHECK(since_push(1) == 10);
+
+    // A failed write: its increments are carried over to the next push,
+    // while counter_since_push() still reports per push
+    inc = push(stats(120, 1500, 55), false);
+    CHECK(inc["requests"] == 10);
+    CHECK(!inc.count("workers.2.requests"));
+    inc = push(stats(125, 1600, 60), true);
+    CHECK(inc["requests"] == 20);
+    CHECK(inc["workers.1.requests"] == 15);
+    CHECK(inc["workers.2.requests"] == 5);
+    CHECK(inc["tx"] == 100);
+    CHECK(since_push(1) == 5);
+
+    // A counter going backwards started over: its value is the increment
+    inc = push(stats(3, 1600, 60), true);
+    CHECK(inc["requests"] == 3);
+    CHECK(inc["workers.1.requests"] == 3);
+    CHECK(since_push(1) == 3);
+
+    // A worker not seen before counts from zero, but has no increment
+    // since the previous push
+    json doc = stats(3, 1600, 60);
+    doc["workers"].push_back({{"id", 3}, {"requests", 7}});
+    inc = push(doc, true);
+    CHECK(inc["requests"] == 7);
+    CHECK(inc["workers.3.requests"] == 7);
+    CHECK(since_push(3) == -1);
+    CHECK(since_push(4) == -1);
+
+    // Entries without an id are skipped
+    doc["workers"].push_back({{"requests", 1000}});
+    inc = push(doc, true);
+    CHECK(inc["requests"] == 0);
+    CHECK(since_push(3) == 0);
+    return test_result("test_counters");
+}
@@ -0,0 +1,88 @@
+#include <uwsgi.h>
+#include "test.h"
+
+// Included rather than linked, to reach the bucket functions
+#include "latency.cc"
+
+static void request(int wid, uint64_t us) {
+    struct wsgi_request req;
+    memset(&req, 0, sizeof(req));
+    req.start_of_request = 1700000000000000ULL;
+    req.end_of_request = req.start_of_request + us;
+    uwsgi.mywid = wid;
+    stats_pusher_mongodb_after_request(&req);
+}
+
+static uint64_t bucket_max_of(uint64_t us) {
+    return latency_bucket_max(latency_bucket(us));
+}
+
+int main() {
+    // Each bucket ends where the next one starts, below 8 one per value,
+    // above at most 12.5% wide
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        uint64_t max = latency_bucket_max(i);
+        CHECK(latency_bucket(max) == i);
+        CHECK(latency_bucket(max + 1) == i + 1);
+        if (i < LATENCY_SUB) {
+            CHECK(max == (uint64_t)i);
+        } else {
+            uint64_t min = latency_bucket_max(i - 1) + 1;
+            CHECK((max - min + 1) * 8 <= min);
+        }
+    }
+    CHECK(latency_bucket(0) == 0);
+    CHECK(latency_bucket(8) == 8 && latency_bucket(15) == 15 && latency_bucket(16) == 16);
+    CHECK(latency_bucket(17) == 16 && latency_bucket(18) == 17);
+    // Past about 25 days, durations are clamped to the last bucket
+    uint64_t last_max = latency_bucket_max(LATENCY_BUCKETS - 1);
+    CHECK(last_max > 25ULL * 86400 * 1000000);
+    CHECK(latency_bucket(last_max + 1) == LATENCY_BUCKETS - 1);
+    CHECK(latency_bucket(last_max * 1000) == LATENCY_BUCKETS - 1);
+    CHECK(latency_bucket(UINT64_MAX) == LATENCY_BUCKETS - 1);
+
+    // Nothing before latency_init() or without requests
+    CHECK(latency_histogram().is_null());
+    uwsgi.numproc = 2;
+    latency_init();
+    CHECK(latency_histogram().is_null());
+
+    // 1..1000 us once each, spread over both workers; outside of a worker
+    // or with a clock going backwards, nothing is recorded
+    for (uint64_t us = 1; us <= 1000; us++) request(1 + us % 2, us);
+    request(0, 5);
+    request(3, 5);
+    request(1, (uint64_t)-5);
+    json h = latency_histogram();
+    CHECK(h["count"] == 1000);
+    CHECK(h["sum_us"] == 500500);
+    CHECK(h["p50_us"] == bucket_max_of(500));
+    CHECK(h["p90_us"] == bucket_max_of(900));
+    CHECK(h["p99_us"] == bucket_max_of(990));
+    CHECK(h["p999_us"] == bucket_max_of(999));
+    CHECK(h["max_us"] == bucket_max_of(1000));
+    uint64_t total = 0;
+    for (auto &bucket : h["buckets"]) {
+        CHECK(bucket[1] > 0);
+        total += bucket[1].get<uint64_t>();
+    }
+    CHECK(total == 1000);
+    CHECK(h["buckets"][0] == json({1, 1}));
+    CHECK(h["buckets"][14] == json({15, 1}));
+    CHECK(h["buckets"][15] == json({17, 2}));
+
+    // Each push reports the requests since the previous one; a skewed
+    // distribution puts p50 low and p99 high
+    CHECK(latency_histogram().is_null());
+    for (int i = 0; i < 98; i++) request(1, 100);
+    request(2, 10000);
+    request(2, 100ULL * 86400 * 1000000);
+    h = latency_histogram();
+    CHECK(h["count"] == 100);
+    CHECK(h["p50_us"] == bucket_max_of(100));
+    CHECK(h["p90_us"] == bucket_max_of(100));
+    CHECK(h["p99_us"] == bucket_max_of(10000));
+    CHECK(h["p999_us"] == latency_bucket_max(LATENCY_BUCKETS - 1));
+    CHECK(h["max_us"] == latency_bucket_max(LATENCY_BUCKETS - 1));
+    return test_result("test_latency");
+}
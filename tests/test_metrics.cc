@@ -0,0 +1,146 @@
+#include <uwsgi.h>
+#include <string>
+#include "test.h"
+
+// Included rather than linked, to reach the key mapping and reset the rules
+#include "transform_metrics.cc"
+
+// The mapping before metric rules, which the default rules must keep
+static std::string baseline_path(std::string key) {
+    std::string path = "/";
+    std::string::size_type max = key.length() - 1;
+    std::string::size_type last = 0;
+    std::string::size_type pos, next;
+    std::string component;
+
+    while (std::string::npos != (pos = key.find(".", last))) {
+        component = key.substr(last, pos - last);
+        bool is_array_key = (pos < max && std::isdigit(key.at(pos + 1)));
+        if (is_array_key) {
+            component += "s";
+            if (component == "workers") {
+                if (std::string::npos != (next = key.find(".", pos + 1))) {
+                    int worker_num = stoi(key.substr(pos + 1, next), nullptr, 10);
+                    if (worker_num == 0) {
+                        last = next + 1;
+                        continue;
+                    } else {
+                        component += "/" + std::to_string(worker_num - 1);
+                        pos = next;
+                    }
+                }
+            }
+        }
+        path += component + "/";
+        last = pos + 1;
+    }
+    path += key.substr(last);
+    return path;
+}
+
+static void reset_rules() {
+    rules.clear();
+    prefix_trie.assign(1, rule_node{{}, -1});
+    component_trie.assign(1, rule_node{{}, -1});
+    plural_any = false;
+    rules_compiled = false;
+    metric_paths.clear();
+}
+
+static bool set_rules(std::initializer_list<const char *> specs) {
+    struct uwsgi_string_list *list = NULL;
+    reset_rules();
+    for (const char *spec : specs) uwsgi_string_new_list(&list, (char *)spec);
+    return compile_metric_rules(list);
+}
+
+// The pointer a metric key maps to, or "dropped"
+static std::string path_of(const char *key) {
+    std::string path;
+    return metrics_key_to_json_pointer_path(key, path) ? path : "dropped";
+}
+
+int main() {
+    // The default rules give the baseline mapping
+    const char *keys[] = {
+        "worker.0.requests", "worker.0.avg_response_time", "worker.1.requests",
+        "worker.2.delta_requests", "worker.12.rss_size", "worker.1.core.0.requests",
+        "worker.3.core.15.write_errors", "worker.1.app.0.requests",
+        "socket.0.listen_queue", "core.busy", "rss_size", "worker.1", "plugin.x.y",
+    };
+    for (const char *key : keys) {
+        if (path_of(key) != baseline_path(key)) {
+            fprintf(stderr, "%s: %s, expected %s\n", key, path_of(key).c_str(),
+                baseline_path(key).c_str());
+        }
+        CHECK(path_of(key) == baseline_path(key));
+    }
+    CHECK(path_of("worker.0.requests") == "/requests");
+    CHECK(path_of("worker.2.requests") == "/workers/1/requests");
+    CHECK(path_of("worker.2.core.3.requests") == "/workers/1/cores/3/requests");
+    CHECK(path_of("socket.0.listen_queue") == "/sockets/0/listen_queue");
+
+    // prefix: longest first, on the whole key
+    CHECK(set_rules({"prefix plugin. ext.", "prefix plugin.cache. cache."}));
+    CHECK(path_of("plugin.cache.hits") == "/cache/hits");
+    CHECK(path_of("plugin.router.hits") == "/ext/router/hits");
+    CHECK(path_of("worker.1.requests") == "/worker/1/requests");
+
+    // drop: leaves matching keys out, unless a longer prefix rule matches
+    CHECK(set_rules({"drop socket.", "drop plugin.", "prefix plugin.keep. kept."}));
+    CHECK(path_of("socket.0.listen_queue") == "dropped");
+    CHECK(path_of("plugin.x") == "dropped");
+    CHECK(path_of("plugin.keep.x") == "/kept/x");
+    CHECK(path_of("sockets") == "/sockets");
+
+    // rename: whole components only
+    CHECK(set_rules({"rename core thread"}));
+    CHECK(path_of("worker.1.core.0.requests") == "/worker/1/thread/0/requests");
+    CHECK(path_of("worker.1.cores.requests") == "/worker/1/cores/requests");
+
+    // plural: named components, or any with *, only before an index
+    CHECK(set_rules({"plural core"}));
+    CHECK(path_of("worker.1.core.0.requests") == "/worker/1/cores/0/requests");
+    CHECK(path_of("core.busy") == "/core/busy");
+    CHECK(set_rules({"plural *"}));
+    CHECK(path_of("worker.1.core.0.requests") == "/workers/1/cores/0/requests");
+    CHECK(set_rules({"rename core thread", "plural core"}));
+    CHECK(path_of("worker.1.core.0.x") == "/worker/1/threads/0/x");
+
+    // offset: shifts the index; below zero, the rest applies to the parent
+    CHECK(set_rules({"offset worker -1"}));
+    CHECK(path_of("worker.1.requests") == "/worker/0/requests");
+    CHECK(path_of("worker.0.requests") == "/requests");
+    CHECK(set_rules({"offset app 2"}));
+    CHECK(path_of("app.0.requests") == "/app/2/requests");
+    CHECK(path_of("app.x.requests") == "/app/x/requests");
+
+    // Invalid rules
+    CHECK(!set_rules({"prefix onlyone"}));
+    CHECK(!set_rules({"drop a b"}));
+    CHECK(!set_rules({"offset worker x"}));
+    CHECK(!set_rules({"plural a b"}));
+    CHECK(!set_rules({"unknown a"}));
+
+    // The values land at their paths, and the section is removed
+    reset_rules();
+    json doc = {
+        {"workers", {{{"id", 1}, {"cores", {{{"id", 0}}}}}}},
+        {"metrics", {
+            {"worker.0.requests", {{"type", "counter"}, {"value", 12}}},
+            {"worker.1.core.0.requests", {{"value", 3}}},
+            {"worker.1.unset", {{"value", nullptr}}},
+            {"worker.1.bad", 5},
+        }},
+    };
+    stats_snapshot snap = stats_from_json(doc);
+    transform_metrics(snap);
+    CHECK(snap.typed);
+    doc = stats_to_json(snap);
+    CHECK(!doc.count("metrics"));
+    CHECK(doc["requests"] == 12);
+    CHECK(doc["workers"][0]["cores"][0]["requests"] == 3);
+    CHECK(!doc["workers"][0].count("unset"));
+    CHECK(!doc["workers"][0].count("bad"));
+    return test_result("test_metrics");
+}
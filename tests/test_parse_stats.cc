@@ -0,0 +1,200 @@
+#include <uwsgi.h>
+#include <string>
+#include <random>
+#include <clocale>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+stats_snapshot parse_stats(const char *data, size_t len);
+
+/**
+ * parse_stats() must return a snapshot of what json::parse() returns,
+ * with the same number types, and throw where it throws.
+ */
+static void check_same(const std::string &text) {
+    json got, expected;
+    bool got_error = false, expected_error = false;
+
+    try {
+        got = stats_to_json(parse_stats(text.data(), text.size()));
+    } catch (json::exception &) {
+        got_error = true;
+    }
+    try {
+        expected = json::parse(text);
+    } catch (json::exception &) {
+        expected_error = true;
+    }
+    CHECK(got_error == expected_error);
+    if (got_error != expected_error || expected_error) {
+        return;
+    }
+    bool same = got == expected && got.dump() == expected.dump();
+    if (!same) {
+        fprintf(stderr, "parse_stats(%s)\n  got %s\n  expected %s\n", text.c_str(),
+            got.dump().c_str(), expected.dump().c_str());
+    }
+    CHECK(same);
+}
+
+static const char *edge_cases[] = {
+    "{}",
+    "[]",
+    " \t\r\n{ \"a\" : 1 }\n",
+    "{\"a\":1,\"a\":2}",
+    "{\"workers\":[{\"id\":1,\"requests\":18446744073709551615,"
+        "\"rss\":-9223372036854775808,\"vsz\":18446744073709551616,\"avg_rt\":1.5e3}]}",
+    "{\"workers\":[{\"status\":\"idle\\u00e9\\ud83d\\ude00\\n\\t\\\"\\\\\\/\"}]}",
+    "{\"workers\":{\"id\":3}}",
+    "{\"workers\":[{\"cores\":[{\"id\":0,\"requests\":\"many\",\"vars\":[],\"req_info\":{}}]}]}",
+    "{\"pid\":\"str\",\"version\":5,\"uid\":null,\"gid\":true}",
+    "{\"x\":\"\xc3\xa9\"}",
+    "{\"n\":12345678901234567890123}",
+    "{\"n\":-12345678901234567}",
+    "{\"n\":1234567890123456789}",
+    "{\"n\":12345678}",
+    "{\"n\":0.1,\"m\":-0.0,\"o\":1E+2,\"p\":5e-324}",
+    "{\"a\":[[[[]]]]}",
+    "[1,2 , -0, 0.0, \"x\\/y\"]",
+    "{\"s\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\\n\"}",
+    // Malformed or out of range: both must throw
+    "",
+    "{",
+    "{\"n\":-}",
+    "{\"n\":01}",
+    "{\"n\":1.}",
+    "{\"n\":1e400}",
+    "{\"n\":-1e400}",
+    "{\"s\":\"\x01\"}",
+    "{\"s\":\"\\x\"}",
+    "{\"a\":1,}",
+    "{\"a\":1} x",
+    "[tru]",
+};
+
+// A random value with the keys of the uWSGI stats document mixed in, so
+// that both the schema driven and the generic paths are exercised
+static json random_value(std::mt19937_64 &rng, int depth) {
+    static const char *keys[] = {
+        "workers", "cores", "sockets", "apps", "locks", "id", "pid", "requests",
+        "exceptions", "status", "rss", "vsz", "tx", "avg_rt", "in_request", "vars",
+        "req_info", "mountpoint", "name", "queue", "x", "caf\xc3\xa9", "a\"b",
+    };
+    int kind = depth > 4 ? (int)(rng() % 6) : (int)(rng() % 8);
+    switch (kind) {
+    case 0:
+        return (uint64_t)(rng() >> (rng() % 64));
+    case 1:
+        return -(int64_t)(rng() >> (1 + rng() % 63));
+    case 2:
+        return (double)(int64_t)rng() / (double)(1 + rng() % 1000000);
+    case 3: {
+        std::string s;
+        for (int n = rng() % 40; n > 0; n--) {
+            int c = rng() % 100;
+            s += c < 2 ? '"' : c < 4 ? '\\' : c < 6 ? '\n' : c < 8 ? '\x7f' :
+                 (char)(' ' + rng() % 95);
+        }
+        if (rng() % 10 == 0) s += "\xe2\x82\xac";
+        return s;
+    }
+    case 4:
+        return rng() % 2 == 0;
+    case 5:
+        return nullptr;
+    case 6: {
+        json array = json::array();
+        for (int n = rng() % 6; n > 0; n--) array.push_back(random_value(rng, depth + 1));
+        return array;
+    }
+    default: {
+        json object = json::object();
+        for (int n = rng() % 8; n > 0; n--) {
+            object[keys[rng() % (sizeof(keys) / sizeof(keys[0]))]] = random_value(rng, depth + 1);
+        }
+        return object;
+    }
+    }
+}
+
+// Every key of a worker, core and app as uWSGI writes them goes to its slot
+static void check_typed() {
+    std::string text = "{\"version\":\"2.0.28\",\"workers\":[{\"id\":1,\"pid\":4121,"
+        "\"accepting\":1,\"requests\":1234567,\"delta_requests\":12,\"exceptions\":3,"
+        "\"harakiri_count\":0,\"signals\":0,\"signal_queue\":0,\"status\":\"idle\","
+        "\"rss\":123456789012,\"vsz\":-5,\"running_time\":987654321,"
+        "\"last_spawn\":1700000000,\"respawn_count\":1,\"tx\":8812001234,\"avg_rt\":12345,"
+        "\"apps\":[{\"id\":0,\"modifier1\":0,\"mountpoint\":\"\",\"startup_time\":1,"
+        "\"requests\":1234567,\"exceptions\":0,\"chdir\":\"/srv/app\"}],"
+        "\"cores\":[{\"id\":0,\"requests\":987654,\"static_requests\":0,"
+        "\"routed_requests\":0,\"offloaded_requests\":0,\"write_errors\":0,"
+        "\"read_errors\":0,\"in_request\":1,\"vars\":[],\"req_info\":{}},"
+        "{\"id\":1,\"in_request\":0,\"vars\":[\"PATH_INFO=/\"],\"req_info\":{\"a\":1},"
+        "\"requests\":1.5}]}]}";
+    stats_snapshot snap = parse_stats(text.data(), text.size());
+    CHECK(snap.typed && snap.workers.size() == 1 && !snap.doc.count("workers"));
+    if (!snap.typed || snap.workers.size() != 1) return;
+
+    const stats_object &worker = snap.workers[0];
+    CHECK(worker.present == (1u << (WORKER_CORES + 1)) - 1);
+    CHECK(worker.extra.is_null());
+    CHECK(stats_uint(worker, WORKER_RSS) == 123456789012ULL);
+    CHECK(stats_int(worker, WORKER_VSZ) == -5);
+    CHECK(worker.strings[0] == "idle");
+    const stats_object &app = (*stats_objects(worker, WORKER_APPS))[0];
+    CHECK(app.present == (1u << APP_FIELDS) - 1 && app.extra.is_null());
+    CHECK(app.strings[1] == "/srv/app");
+
+    const std::vector<stats_object> &cores = *stats_objects(worker, WORKER_CORES);
+    CHECK(cores[0].present == (1u << CORE_EXCEPTIONS) - 1 && cores[0].extra.is_null());
+    // Values of an unexpected type, and vars and req_info in a request,
+    // are kept as json
+    CHECK(cores[1].present == ((1u << CORE_ID) | (1u << CORE_IN_REQUEST)));
+    CHECK(cores[1].extra.size() == 3);
+    CHECK(stats_double(cores[1], CORE_REQUESTS) == 1.5);
+    CHECK(stats_to_json(snap) == json::parse(text));
+
+    // Known keys are found out of order and with escapes, and a duplicate
+    // key replaces the value before it, typed or not
+    text = "{\"workers\":[{\"tx\":1,\"i\\u0064\":2,\"tx\":\"x\",\"rss\":\"y\","
+        "\"rss\":3}]}";
+    snap = parse_stats(text.data(), text.size());
+    CHECK(snap.typed);
+    CHECK(stats_uint(snap.workers[0], WORKER_ID) == 2);
+    CHECK(!(snap.workers[0].present & (1u << WORKER_TX)));
+    CHECK(stats_uint(snap.workers[0], WORKER_RSS) == 3);
+    CHECK(snap.workers[0].extra.size() == 1);
+    CHECK(stats_to_json(snap) == json::parse(text));
+
+    // Workers that are not all objects stay json
+    text = "{\"workers\":[{\"id\":1},2]}";
+    snap = parse_stats(text.data(), text.size());
+    CHECK(!snap.typed && snap.doc["workers"] == json::parse(text)["workers"]);
+}
+
+int main() {
+    for (const char *text : edge_cases) {
+        check_same(text);
+    }
+    check_typed();
+
+    // Fractions do not depend on the decimal separator of the locale
+    if (setlocale(LC_NUMERIC, "de_DE.UTF-8") || setlocale(LC_NUMERIC, "fr_FR.UTF-8")) {
+        check_same("{\"workers\":[{\"avg_rt\":1.5,\"load\":-2.25e3}],\"load\":0.5}");
+        setlocale(LC_NUMERIC, "C");
+    }
+
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 3000; i++) {
+        json doc = json::object();
+        for (int n = rng() % 6; n > 0; n--) {
+            doc[i % 3 ? "workers" : "sockets"].push_back(random_value(rng, 1));
+        }
+        doc["version"] = "2.0.28";
+        // Compact and pretty printed, as uWSGI produces either
+        check_same(doc.dump());
+        check_same(doc.dump(1, '\t'));
+    }
+    return test_result("test_parse_stats");
+}
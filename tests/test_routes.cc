@@ -0,0 +1,111 @@
+#include <uwsgi.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "test.h"
+
+// Included rather than linked, to reach the shared table and the rule cache
+#include "routes.cc"
+
+static __thread struct wsgi_request thread_req;
+
+static void request(const char *path, int status, uint64_t us) {
+    thread_req.path_info = (char *)path;
+    thread_req.path_info_len = strlen(path);
+    thread_req.status = status;
+    thread_req.start_of_request = 1000;
+    thread_req.end_of_request = 1000 + us;
+    stats_pusher_mongodb_routes_after_request(&thread_req);
+}
+
+// The drained routes by name
+static std::map<std::string, json> drain() {
+    std::map<std::string, json> out;
+    json list = routes_drain();
+    if (list.is_null()) return out;
+    for (auto &route : list) {
+        CHECK(!out.count(route["route"]));
+        out[route["route"]] = route;
+    }
+    return out;
+}
+
+static std::string route_name(const char *path) {
+    char route[ROUTE_MAX];
+    size_t len = route_of(path, strlen(path), route);
+    CHECK(len == strlen(route));
+    return route;
+}
+
+int main() {
+    struct uwsgi_string_list *rules = NULL;
+    uwsgi_string_new_list(&rules, (char *)"/admin/ /admin");
+    uwsgi_string_new_list(&rules, (char *)"~^/static/.*\\.css$ css");
+    CHECK(routes_init(rules, 7));
+
+    // Normalization: rules in order, then identifier segments
+    CHECK(route_name("/users/42/orders/9f1c2e7a0b") == "/users/:id/orders/:id");
+    CHECK(route_name("/users/7/orders/deadbeef12") == "/users/:id/orders/:id");
+    CHECK(route_name("/users/me/f47ac10b-58cc-4372-a567-0e02b2c3d479") == "/users/me/:id");
+    CHECK(route_name("/users/abcdefgh") == "/users/abcdefgh");
+    CHECK(route_name("/admin/x/y") == "/admin");
+    CHECK(route_name("/static/a/b.css") == "css");
+    CHECK(route_name("/static/a/b.js") == "/static/a/b.js");
+    // Rule matches are cached per path, and the cache gives the same answer
+    CHECK(route_cache != NULL);
+    CHECK(route_name("/static/a/b.css") == "css");
+    CHECK(route_name("/static/a/b.js") == "/static/a/b.js");
+
+    request("/users/42/orders/9f1c2e7a0b", 200, 100);
+    request("/users/7/orders/deadbeef12", 503, 300);
+    request("/admin/x/y", 200, 10);
+    auto drained = drain();
+    CHECK(drained.size() == 2);
+    CHECK(drained["/users/:id/orders/:id"]["requests"] == 2);
+    CHECK(drained["/users/:id/orders/:id"]["errors"] == 1);
+    CHECK(drained["/users/:id/orders/:id"]["sum_us"] == 400);
+    CHECK(drained["/users/:id/orders/:id"]["mean_us"] == 200);
+    CHECK(drained["/admin"]["requests"] == 1);
+    // Drained counters start over
+    CHECK(drain().empty());
+
+    // A route whose hash collides with a claimed slot gets a slot of its own
+    uint64_t hash = route_hash("/a", 2);
+    struct route_entry *other_route = &routes->entries[hash & (routes->size - 1)];
+    other_route->hash = hash;
+    strcpy(other_route->route, "/zzz");
+    other_route->ready = 1;
+    routes->used++;
+    request("/a", 200, 5);
+    CHECK(other_route->requests == 0);
+    drained = drain();
+    CHECK(drained.size() == 1);
+    CHECK(drained["/a"]["requests"] == 1);
+
+    // Cores racing to claim slots: 4 routes for the 3 places left of the 7,
+    // so whichever comes last is counted under "other"
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([] {
+            static const char *paths[] = {"/r0", "/r1", "/r2", "/r3"};
+            for (int i = 0; i < 20000; i++) request(paths[i % 4], 200, 1);
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    drained = drain();
+    CHECK(drained.size() == 4);
+    uint64_t total = 0;
+    for (auto &route : drained) {
+        CHECK(route.second["requests"] == 20000);
+        total += route.second["requests"].get<uint64_t>();
+    }
+    CHECK(total == 80000);
+    CHECK(drained.count("other"));
+    CHECK(routes->used == routes->max);
+
+    // A route seen once keeps its slot
+    request("/a", 200, 5);
+    CHECK(drain()["/a"]["requests"] == 1);
+    return test_result("test_routes");
+}
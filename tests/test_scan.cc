@@ -0,0 +1,97 @@
+#include <uwsgi.h>
+#include <string>
+#include <vector>
+#include <random>
+#include "test.h"
+
+// Included rather than linked, to test every implementation the CPU has
+// and not only the one chosen at first use
+#include "scan.cc"
+
+typedef const char *(*scan_fn)(const char *, const char *);
+
+struct scan_impl {
+    const char *name;
+    scan_fn fn;
+};
+
+/**
+ * Every implementation must stop at the same byte as the scalar one, for
+ * each stopping byte at each position of runs around the vector widths,
+ * and must not read past 'end'.
+ */
+static void check_scan(const char *what, const scan_impl *impls, size_t count,
+                       scan_fn reference, const std::string &fill,
+                       const std::string &stops) {
+    for (size_t len = 0; len <= 80; len++) {
+        for (size_t pos = 0; pos <= len; pos++) {
+            for (char stop : stops) {
+                std::string buf;
+                for (size_t i = 0; i < len; i++) buf += fill[i % fill.size()];
+                if (pos < len) buf[pos] = stop;
+                // Plain bytes past the end must not be scanned
+                std::string padded = buf;
+                for (size_t i = 0; i < 64; i++) padded += fill[i % fill.size()];
+                const char *p = padded.data(), *end = p + len;
+                const char *expected = reference(p, end);
+                CHECK(expected == p + pos);
+                for (size_t i = 0; i < count; i++) {
+                    const char *got = impls[i].fn(p, end);
+                    if (got != expected) {
+                        fprintf(stderr, "%s %s: len %zu, stop 0x%02x at %zu: got %td\n",
+                            what, impls[i].name, len, (unsigned char)stop, pos, got - p);
+                    }
+                    CHECK(got == expected);
+                }
+            }
+        }
+    }
+}
+
+static void check_digits8() {
+    std::mt19937_64 rng(42);
+    uint64_t value;
+
+    for (int i = 0; i < 1000000; i++) {
+        uint64_t n = rng() % 100000000ULL;
+        char buf[9];
+        snprintf(buf, sizeof(buf), "%08llu", (unsigned long long)n);
+        CHECK(scan_digits8(buf, value) && value == n);
+    }
+    // Any byte that is not a digit, at any position, is refused
+    for (int pos = 0; pos < 8; pos++) {
+        for (int c = 0; c < 256; c++) {
+            char buf[9] = "12345678";
+            buf[pos] = (char)c;
+            CHECK(scan_digits8(buf, value) == (c >= '0' && c <= '9'));
+        }
+    }
+}
+
+int main() {
+    std::string plain_bytes, string_stops, ws_stops;
+    for (int c = 0; c < 256; c++) {
+        if (plain((unsigned char)c)) plain_bytes += (char)c;
+        else string_stops += (char)c;
+        if (!ws((char)c)) ws_stops += (char)c;
+    }
+
+    std::vector<scan_impl> strings = {{"scan_string", scan_string}};
+    std::vector<scan_impl> blanks = {{"scan_ws", scan_ws}};
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        strings.push_back({"sse2", scan_string_sse2});
+        blanks.push_back({"sse2", scan_ws_sse2});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        strings.push_back({"avx2", scan_string_avx2});
+    }
+#endif
+
+    check_scan("string", strings.data(), strings.size(), scan_string_scalar,
+        plain_bytes, string_stops);
+    check_scan("ws", blanks.data(), blanks.size(), scan_ws_scalar, " \t\r\n", ws_stops);
+    check_digits8();
+    return test_result("test_scan");
+}
@@ -0,0 +1,129 @@
+#include <uwsgi.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "test.h"
+
+// Included rather than linked, to reach the reservoirs
+#include "slow.cc"
+
+static __thread struct wsgi_request thread_req;
+
+static void request(const char *path, uint64_t us, int status = 200) {
+    thread_req.method = (char *)"GET";
+    thread_req.method_len = 3;
+    thread_req.path_info = (char *)path;
+    thread_req.path_info_len = strlen(path);
+    thread_req.status = status;
+    thread_req.start_of_request = 1700000000000000ULL;
+    thread_req.end_of_request = thread_req.start_of_request + us;
+    stats_pusher_mongodb_slow_after_request(&thread_req);
+}
+
+// Slow requests of unique durations from 'threads' cores of worker 1,
+// drained while they run: every request is counted once, and no sample is
+// reported twice, as it would be if a drain took a slot counted in its
+// period that still held the sample of an earlier one
+static void check_concurrent_drains(int threads) {
+    std::atomic<uint64_t> next(20000);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> cores;
+    std::set<uint64_t> reported;
+    uint64_t seen_total = 0, seen;
+
+    for (int t = 0; t < threads; t++) {
+        cores.emplace_back([&] {
+            for (int i = 0; i < 200000; i++) request("/race", next++);
+        });
+    }
+    std::thread drainer([&] {
+        while (!done) {
+            json samples = slow_drain(&seen);
+            seen_total += seen;
+            CHECK(samples.size() <= seen);
+            for (auto &s : samples) {
+                CHECK(reported.insert(s["duration_us"].get<uint64_t>()).second);
+            }
+        }
+    });
+    for (auto &core : cores) core.join();
+    done = true;
+    drainer.join();
+    json samples = slow_drain(&seen);
+    seen_total += seen;
+    for (auto &s : samples) {
+        CHECK(reported.insert(s["duration_us"].get<uint64_t>()).second);
+    }
+    CHECK(seen_total == next - 20000);
+}
+
+int main() {
+    uwsgi.numproc = 2;
+    uwsgi.mywid = 1;
+    uint64_t seen;
+
+    // Guards: nothing is drained before slow_init(), and nothing is
+    // recorded outside of a worker or from a clock going backwards
+    CHECK(slow_drain(&seen).empty() && seen == 0);
+
+    slow_init(10, 4);
+    thread_req.start_of_request = 2000;
+    thread_req.end_of_request = 1000;
+    stats_pusher_mongodb_slow_after_request(&thread_req);
+    uwsgi.mywid = 0;
+    request("/master", 50000);
+    uwsgi.mywid = 3;
+    request("/unknown", 50000);
+    uwsgi.mywid = 1;
+    CHECK(slow_drain(&seen).empty() && seen == 0);
+
+    // Below the reservoir size, every slow request is kept
+    request("/fast", 9999);
+    request("/slow", 10000, 504);
+    request(std::string(200, 'x').c_str(), 25000);
+    uwsgi.mywid = 2;
+    request("/other", 12000);
+    uwsgi.mywid = 1;
+    json samples = slow_drain(&seen);
+    CHECK(seen == 3);
+    CHECK(samples.size() == 3);
+    CHECK(samples[0]["worker"] == 1);
+    CHECK(samples[0]["method"] == "GET");
+    CHECK(samples[0]["path"] == "/slow");
+    CHECK(samples[0]["status"] == 504);
+    CHECK(samples[0]["duration_us"] == 10000);
+    CHECK(samples[0]["time_ms"] == 1700000000010ULL);
+    CHECK(samples[1]["path"].get<std::string>().size() == 127);
+    CHECK(samples[2]["worker"] == 2);
+    // Drained reservoirs start over
+    CHECK(slow_drain(&seen).empty() && seen == 0);
+
+    // A request counted in a period but not written yet leaves its slot
+    // with the sample of an earlier period, which is not reported again
+    request("/once", 30000);
+    CHECK(slow_drain(&seen).size() == 1 && seen == 1);
+    __atomic_fetch_add(&slow_ring_of(1)->state, 1, __ATOMIC_RELAXED);
+    CHECK(slow_drain(&seen).empty() && seen == 1);
+
+    // Past it, each of the slow requests is kept with the same probability
+    const int trials = 20000, requests = 20;
+    std::vector<int> kept(requests);
+    for (int t = 0; t < trials; t++) {
+        for (int i = 0; i < requests; i++) request("/sampled", 10000 + i);
+        samples = slow_drain(&seen);
+        CHECK(seen == requests && samples.size() <= 4);
+        for (auto &s : samples) kept[s["duration_us"].get<int>() - 10000]++;
+    }
+    int expected = trials * 4 / requests;
+    for (int i = 0; i < requests; i++) {
+        if (kept[i] < expected * 9 / 10 || kept[i] > expected * 11 / 10) {
+            fprintf(stderr, "request %d kept %d times, expected about %d\n", i, kept[i], expected);
+        }
+        CHECK(kept[i] >= expected * 9 / 10 && kept[i] <= expected * 11 / 10);
+    }
+
+    check_concurrent_drains(4);
+    return test_result("test_slow");
+}
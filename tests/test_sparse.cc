@@ -0,0 +1,169 @@
+#include <uwsgi.h>
+#include <random>
+#include <set>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+void sparse_workers(stats_snapshot &snap, int top_k);
+
+static void sparse(json &doc, int top_k) {
+    stats_snapshot snap = stats_from_json(doc);
+    sparse_workers(snap, top_k);
+    doc = stats_to_json(snap);
+}
+
+static const char *worker_keys[] = {
+    "id", "pid", "requests", "delta_requests", "exceptions", "harakiri_count", "signals",
+    "status", "rss", "vsz", "running_time", "respawn_count", "tx", "avg_rt", "apps", "cores",
+    NULL,
+};
+static const char *core_keys[] = {
+    "id", "requests", "static_requests", "routed_requests", "offloaded_requests",
+    "write_errors", "read_errors", "in_request", "vars", "req_info", NULL,
+};
+
+// Mostly zero, as on an instance with more workers than traffic
+static uint64_t sometimes(std::mt19937_64 &rng) {
+    return rng() % 3 ? 0 : rng() % 100000;
+}
+
+static json stats_doc(std::mt19937_64 &rng, int workers, int cores) {
+    json doc = {{"version", "2.0.28"}, {"workers", json::array()}};
+    for (int w = 1; w <= workers; w++) {
+        json worker = {{"id", w}, {"status", rng() % 2 ? "idle" : "busy"},
+            {"apps", json::array()}, {"cores", json::array()}};
+        for (const char **key = worker_keys; *key; key++) {
+            if (!worker.count(*key)) worker[*key] = sometimes(rng);
+        }
+        if (rng() % 2) worker["apps"].push_back({{"id", 0}, {"requests", sometimes(rng)}});
+        for (int c = 0; c < cores; c++) {
+            json core = {{"id", c}, {"vars", json::array()}, {"req_info", json::object()}};
+            for (const char **key = core_keys; *key; key++) {
+                if (!core.count(*key)) core[*key] = rng() % 2 ? 0 : sometimes(rng);
+            }
+            if (rng() % 4 == 0) {
+                core["vars"].push_back("PATH_INFO=/");
+                core["req_info"]["request_start"] = 1700000000;
+            }
+            worker["cores"].push_back(core);
+        }
+        doc["workers"].push_back(worker);
+    }
+    return doc;
+}
+
+// The reconstruction the sparse_workers() documentation gives readers
+static void fill_defaults(json &obj, const char **keys) {
+    for (const char **key = keys; *key; key++) {
+        if (obj.count(*key)) continue;
+        std::string k = *key;
+        if (k == "apps" || k == "cores" || k == "vars") {
+            obj[k] = json::array();
+        } else if (k == "req_info") {
+            obj[k] = json::object();
+        } else {
+            obj[k] = 0;
+        }
+    }
+}
+
+static json rebuild_worker(json worker) {
+    fill_defaults(worker, worker_keys);
+    json &cores = worker["cores"];
+    for (auto &core : cores) {
+        if (core.is_object()) fill_defaults(core, core_keys);
+    }
+    if (worker.count("idle_cores")) {
+        for (auto &i : worker["idle_cores"]) {
+            json core = {{"id", i}};
+            fill_defaults(core, core_keys);
+            cores.insert(cores.begin() + i.get<size_t>(), core);
+        }
+        worker.erase("idle_cores");
+    }
+    return worker;
+}
+
+int main() {
+    std::mt19937_64 rng(7);
+
+    // Elided workers and cores rebuild into the original ones, and the
+    // elision does shrink them
+    for (int round = 0; round < 50; round++) {
+        json doc = stats_doc(rng, 1 + round % 8, 1 + round % 5);
+        json original = doc;
+        sparse(doc, 0);
+        CHECK(doc["sparse"] == true);
+        CHECK(!doc.count("other_workers"));
+        CHECK(doc["version"] == original["version"]);
+        CHECK(doc["workers"].size() == original["workers"].size());
+        CHECK(doc.dump().size() < original.dump().size());
+        for (size_t w = 0; w < doc["workers"].size(); w++) {
+            CHECK(rebuild_worker(doc["workers"][w]) == original["workers"][w]);
+        }
+    }
+
+    // Workers that are not all objects, and a worker with a core that is
+    // not an object, are elided all the same
+    for (int round = 0; round < 10; round++) {
+        json doc = stats_doc(rng, 3, 3);
+        doc["workers"][0]["cores"].push_back("not a core");
+        if (round % 2) doc["workers"].push_back("not a worker");
+        json original = doc;
+        sparse(doc, 0);
+        CHECK(doc["sparse"] == true);
+        for (size_t w = 0; w < 3; w++) {
+            json rebuilt = rebuild_worker(doc["workers"][w]);
+            CHECK(rebuilt == original["workers"][w]);
+        }
+    }
+
+    // A worker and core with nothing but zeros keep only their id
+    json doc = stats_doc(rng, 1, 2);
+    for (auto &item : doc["workers"][0].items()) {
+        if (item.key() != "id" && item.value().is_number()) item.value() = 0;
+    }
+    doc["workers"][0]["status"] = "idle";
+    doc["workers"][0]["apps"] = json::array();
+    for (auto &core : doc["workers"][0]["cores"]) {
+        for (const char **key = core_keys; *key; key++) {
+            if (std::string(*key) != "id") core[*key] = 0;
+        }
+        core["vars"] = json::array();
+        core["req_info"] = json::object();
+    }
+    doc["workers"][0]["cores"][1]["in_request"] = 1;
+    sparse(doc, 0);
+    CHECK(doc["workers"][0] == json({{"id", 1}, {"status", "idle"}, {"idle_cores", {0}},
+        {"cores", {{{"id", 1}, {"in_request", 1}}}}}));
+
+    // With top_k, the busiest workers stay in full detail, in id order, and
+    // the others are summed
+    doc = stats_doc(rng, 6, 3);
+    uint64_t delta[] = {5, 50, 0, 500, 7, 50};
+    for (int w = 0; w < 6; w++) doc["workers"][w]["delta_requests"] = delta[w];
+    json original = doc;
+    sparse(doc, 3);
+    CHECK(doc["sparse"] == true);
+    CHECK(doc["workers"].size() == 3);
+    CHECK(doc["workers"][0] == original["workers"][1]);
+    CHECK(doc["workers"][1] == original["workers"][3]);
+    CHECK(doc["workers"][2] == original["workers"][5]);
+    // Listed from the busiest
+    json &other = doc["other_workers"];
+    CHECK(other["ids"] == json({5, 1, 3}));
+    for (const char *key : {"requests", "delta_requests", "exceptions", "harakiri_count",
+            "tx", "rss", "vsz"}) {
+        uint64_t sum = 0;
+        for (int w : {0, 2, 4}) sum += original["workers"][w][key].get<uint64_t>();
+        CHECK(other[key] == sum);
+    }
+
+    // Top-K covering every worker leaves them all as they were
+    doc = original;
+    sparse(doc, 6);
+    CHECK(doc["workers"] == original["workers"]);
+    CHECK(!doc.count("other_workers"));
+    return test_result("test_sparse");
+}
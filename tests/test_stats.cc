@@ -0,0 +1,193 @@
+#include <uwsgi.h>
+#include <random>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+static json random_value(std::mt19937_64 &rng, int depth);
+
+static json random_object(std::mt19937_64 &rng, int depth) {
+    static const char *keys[] = {
+        "id", "requests", "status", "tx", "cores", "apps", "vars", "req_info", "in_request",
+        "x", "a/b",
+    };
+    json obj = json::object();
+    for (int n = rng() % 5; n > 0; n--) {
+        obj[keys[rng() % (sizeof(keys) / sizeof(keys[0]))]] = random_value(rng, depth + 1);
+    }
+    return obj;
+}
+
+static json random_value(std::mt19937_64 &rng, int depth) {
+    switch (depth > 3 ? rng() % 5 : rng() % 8) {
+    case 0:
+        return (uint64_t)(rng() % 1000);
+    case 1:
+        return -(int64_t)(rng() % 1000);
+    case 2:
+        return rng() % 2 ? "idle" : "";
+    case 3:
+        return 0.5;
+    case 4:
+        return nullptr;
+    case 5:
+        return json::array();
+    case 6: {
+        json list = json::array();
+        for (int n = rng() % 3; n > 0; n--) list.push_back(random_object(rng, depth + 1));
+        if (rng() % 8 == 0) list.push_back(1);
+        return list;
+    }
+    default:
+        return random_object(rng, depth);
+    }
+}
+
+static json random_doc(std::mt19937_64 &rng) {
+    json doc = {{"version", "2.0.28"}, {"workers", json::array()}};
+    for (int w = rng() % 4; w > 0; w--) {
+        json worker = {{"id", w}, {"requests", (uint64_t)rng() % 100}, {"status", "idle"},
+            {"cores", {{{"id", 0}, {"vars", json::array()}, {"req_info", json::object()}}}},
+            {"apps", json::array()}};
+        if (rng() % 3 == 0) worker["extra"] = random_value(rng, 2);
+        doc["workers"].push_back(worker);
+    }
+    return doc;
+}
+
+static std::string random_pointer(std::mt19937_64 &rng) {
+    static const char *tokens[] = {
+        "workers", "workers", "0", "1", "-", "cores", "apps", "id", "requests", "status",
+        "vars", "req_info", "x", "a~1b", "01", "",
+    };
+    std::string pointer;
+    for (int n = 1 + rng() % 5; n > 0; n--) {
+        pointer += "/";
+        pointer += tokens[rng() % (sizeof(tokens) / sizeof(tokens[0]))];
+    }
+    return pointer;
+}
+
+// Whether setting the pointer would fill an array gap, which json fills
+// with nulls and the snapshot with empty typed objects
+static bool fills_gap(const json &doc, const stats_path &path) {
+    const json *node = &doc;
+    for (auto &token : path.tokens) {
+        if (node->is_array()) {
+            if (token == "-") return false;
+            if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            size_t i = std::stoul(token);
+            if (i > node->size()) return true;
+            if (i == node->size()) return false;
+            node = &(*node)[i];
+        } else if (node->is_object()) {
+            auto it = node->find(token);
+            if (it == node->end()) return false;
+            node = &*it;
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * stats_set() and stats_at() must do on a snapshot what json's operator[]
+ * and at() do with the same pointer on the document it stands for,
+ * throwing where they throw.
+ */
+static void check_random_sets() {
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 3000; i++) {
+        json doc = random_doc(rng);
+        stats_snapshot snap = stats_from_json(doc);
+        CHECK(snap.typed);
+        for (int n = 0; n < 8; n++) {
+            stats_path path = stats_path_of(random_pointer(rng));
+            json value = random_value(rng, 1);
+            if (fills_gap(doc, path)) continue;
+
+            bool expected_error = false, got_error = false;
+            try {
+                doc[path.ptr] = value;
+            } catch (json::exception &) {
+                expected_error = true;
+            }
+            try {
+                stats_set(snap, path, value);
+            } catch (json::exception &) {
+                got_error = true;
+            }
+            CHECK(got_error == expected_error);
+            json got = stats_to_json(snap);
+            if (got != doc) {
+                fprintf(stderr, "set %s = %s\n  got %s\n  expected %s\n",
+                    path.ptr.to_string().c_str(), value.dump().c_str(), got.dump().c_str(),
+                    doc.dump().c_str());
+                CHECK(got == doc);
+                return;
+            }
+
+            path = stats_path_of(random_pointer(rng));
+            json at_expected, at_got;
+            expected_error = got_error = false;
+            try {
+                at_expected = doc.at(path.ptr);
+            } catch (json::exception &) {
+                expected_error = true;
+            }
+            try {
+                at_got = stats_at(snap, path);
+            } catch (json::exception &) {
+                got_error = true;
+            }
+            CHECK(got_error == expected_error && at_got == at_expected);
+        }
+    }
+}
+
+int main() {
+    // Pointer tokens are unescaped
+    stats_path path = stats_path_of("/a~1b/~0c/~01/");
+    CHECK(path.tokens == std::vector<std::string>({"a/b", "~c", "~1", ""}));
+    CHECK(stats_path_of("").tokens.empty());
+    CHECK(stats_path_of("/").tokens == std::vector<std::string>({""}));
+
+    // Known keys of the expected type go to their slot, the others to
+    // 'extra'; the accessors read both
+    json worker = {{"id", 3}, {"rss", -7}, {"avg_rt", 2.5}, {"status", 1},
+        {"cores", {{{"id", 0}}, 1}}, {"apps", json::array()}, {"custom", "x"}};
+    stats_snapshot snap = stats_from_json({{"workers", {worker}}});
+    CHECK(snap.typed && snap.workers.size() == 1);
+    const stats_object &w = snap.workers[0];
+    CHECK(w.present == ((1u << WORKER_ID) | (1u << WORKER_RSS) | (1u << WORKER_APPS)));
+    CHECK(w.extra.size() == 4);
+    CHECK(stats_uint(w, WORKER_ID) == 3);
+    CHECK(stats_int(w, WORKER_RSS) == -7);
+    CHECK(stats_double(w, WORKER_AVG_RT) == 2.5);
+    CHECK(stats_uint(w, WORKER_STATUS, 9) == 1);
+    CHECK(stats_uint(w, WORKER_CORES, 9) == 9);
+    CHECK(stats_uint(w, WORKER_TX, 9) == 9 && !stats_has(w, WORKER_TX));
+    CHECK(stats_has(w, WORKER_CORES) && !stats_objects(w, WORKER_CORES));
+    CHECK(stats_objects(w, WORKER_APPS)->empty());
+    CHECK(stats_to_json(snap) == json({{"workers", {worker}}}));
+
+    // Documents without an array of objects for workers stay json
+    CHECK(!stats_from_json({{"workers", {1}}}).typed);
+    CHECK(!stats_from_json({{"workers", 1}}).typed);
+    CHECK(!stats_from_json(json::array()).typed);
+
+    // Typed workers and cores are extended with empty objects
+    stats_set(snap, stats_path_of("/workers/2/cores/1/requests"), 5);
+    CHECK(snap.typed && snap.workers.size() == 3);
+    CHECK(stats_objects(snap.workers[2], WORKER_CORES) == NULL);
+    stats_set(snap, stats_path_of("/workers/1/cores"), json::array());
+    stats_set(snap, stats_path_of("/workers/1/cores/1/requests"), 5);
+    CHECK(stats_objects(snap.workers[1], WORKER_CORES)->size() == 2);
+    CHECK(stats_at(snap, stats_path_of("/workers/1/cores/0")) == json::object());
+
+    check_random_sets();
+    return test_result("test_stats");
+}
@@ -0,0 +1,66 @@
+#include <uwsgi.h>
+#include "json.hpp"
+#include "stats.h"
+#include "test.h"
+
+void counter_snapshot(const stats_snapshot &snap);
+json worker_summary(const stats_snapshot &snap);
+
+static json worker(int id, int avg_rt, uint64_t requests, int busy_cores, int cores) {
+    json w = {{"id", id}, {"avg_rt", avg_rt}, {"rss", id * 1000}, {"vsz", id * 2000},
+        {"requests", requests}, {"cores", json::array()}};
+    for (int c = 0; c < cores; c++) {
+        w["cores"].push_back({{"id", c}, {"in_request", c < busy_cores ? 1 : 0}});
+    }
+    return w;
+}
+
+// A push: the snapshot, then its summary
+static json push(const json &doc) {
+    stats_snapshot snap = stats_from_json(doc);
+    counter_snapshot(snap);
+    return worker_summary(snap);
+}
+
+int main() {
+    CHECK(push(json::object()).is_null());
+    CHECK(push({{"workers", json::array()}}).is_null());
+    CHECK(push({{"workers", {1, "x"}}}).is_null());
+
+    json doc = {{"workers", {
+        worker(1, 100, 1000, 0, 4), worker(2, 400, 500, 4, 4),
+        worker(3, 300, 200, 1, 4), worker(4, 200, 0, 2, 4), "not a worker",
+    }}};
+
+    // The first push has no previous counters, hence no requests: they
+    // would be lifetime totals
+    json summary = push(doc);
+    CHECK(summary["workers"] == 4);
+    CHECK(!summary.count("requests"));
+    CHECK(summary["avg_rt"]["min"] == 100);
+    CHECK(summary["avg_rt"]["max"] == 400);
+    CHECK(summary["avg_rt"]["mean"] == 250);
+    // Nearest rank: p50 is the 2nd of 4, p95 and p99 the 4th
+    CHECK(summary["avg_rt"]["p50"] == 200);
+    CHECK(summary["avg_rt"]["p95"] == 400);
+    CHECK(summary["avg_rt"]["p99"] == 400);
+    CHECK(summary["rss"]["max"] == 4000);
+    CHECK(summary["vsz"]["min"] == 2000);
+    CHECK(summary["busy"]["min"] == 0);
+    CHECK(summary["busy"]["max"] == 1);
+    CHECK(summary["busy"]["mean"] == 0.4375);
+
+    // Then the requests since the previous push, of the workers it had
+    doc["workers"][0]["requests"] = 1010;
+    doc["workers"][1]["requests"] = 530;
+    doc["workers"][2]["requests"] = 220;
+    doc["workers"][3]["requests"] = 40;
+    doc["workers"].push_back(worker(5, 100, 9000, 0, 1));
+    summary = push(doc);
+    CHECK(summary["workers"] == 5);
+    CHECK(summary["requests"]["min"] == 10);
+    CHECK(summary["requests"]["max"] == 40);
+    CHECK(summary["requests"]["mean"] == 25);
+    CHECK(summary["requests"]["p50"] == 20);
+    return test_result("test_summary");
+}
@@ -0,0 +1,45 @@
+#include <uwsgi.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include "test.h"
+
+/**
+ * The few uWSGI core symbols the plugin sources use, so that they can be
+ * linked into test programs without the uwsgi binary. Shared memory is
+ * plain memory here: the tests run in a single process.
+ */
+struct uwsgi_server uwsgi;
+int test_failures = 0;
+
+void uwsgi_log(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void *uwsgi_calloc(size_t size) {
+    void *ptr = calloc(1, size);
+    if (!ptr) abort();
+    return ptr;
+}
+
+void *uwsgi_calloc_shared(size_t size) {
+    return uwsgi_calloc(size);
+}
+
+struct uwsgi_string_list *uwsgi_string_new_list(struct uwsgi_string_list **list, char *value) {
+    struct uwsgi_string_list *usl = (struct uwsgi_string_list *)uwsgi_calloc(
+        sizeof(struct uwsgi_string_list));
+    usl->value = value;
+    usl->len = strlen(value);
+    while (*list) list = &(*list)->next;
+    *list = usl;
+    return usl;
+}
+
+uint64_t uwsgi_micros() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
@@ -1,17 +1,156 @@
 #include <uwsgi.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include <cstdlib>
 #include "json.hpp"
-using json = nlohmann::json;
+#include "stats.h"
 
 /**
- * Transforms invalid [1] metric keys (e.g. worker.0.core.0.requests) into
- * JSON pointer notation [2] (e.g. "/workers/0/cores/0/requests"). This is
- * then used by nlohmann::json::patch [3] to set the value in the appropriate
- * place in the stats JSON object.
+ * A rewrite rule for metric keys, set with mongo-stats-metric-rule as one
+ * of:
+ *
+ *     prefix <from> <to>   replace a leading <from> of the key with <to>
+ *     drop <prefix>        leave metrics whose key starts with <prefix> out
+ *     rename <name> <to>   rename the key component <name>
+ *     plural <name>|*      append "s" to <name> (* for any component) when
+ *                          it is followed by an array index
+ *     offset <name> <n>    add <n> to the array index following <name>; a
+ *                          negative result drops both, so the rest of the
+ *                          key applies to the enclosing object
+ *
+ * Prefix and drop rules are matched on the whole key, longest prefix
+ * first; the others on whole key components.
+ */
+struct key_rule {
+    bool drop;
+    bool prefix;
+    std::string to;
+    bool plural;
+    bool offset;
+    long index_offset;
+    bool rename;
+};
+
+/**
+ * The rules are compiled into two character tries, one for key prefixes
+ * and one for components, so a key is rewritten in a single walk of its
+ * characters.
+ */
+struct rule_node {
+    std::map<char, std::size_t> next;
+    int rule;
+};
+
+static std::vector<key_rule> rules;
+static std::vector<rule_node> prefix_trie(1, rule_node{{}, -1});
+static std::vector<rule_node> component_trie(1, rule_node{{}, -1});
+static bool plural_any = false;
+static bool rules_compiled = false;
+
+static key_rule &rule_for(std::vector<rule_node> &trie, const std::string &name) {
+    std::size_t node = 0;
+    for (char c : name) {
+        auto it = trie[node].next.find(c);
+        if (it == trie[node].next.end()) {
+            trie.push_back(rule_node{{}, -1});
+            it = trie[node].next.emplace(c, trie.size() - 1).first;
+        }
+        node = it->second;
+    }
+    if (trie[node].rule < 0) {
+        trie[node].rule = rules.size();
+        rules.push_back(key_rule{false, false, "", false, false, 0, false});
+    }
+    return rules[trie[node].rule];
+}
+
+static bool add_rule(const char *spec) {
+    std::istringstream in(spec);
+    std::string kind, name, arg, extra;
+
+    in >> kind >> name;
+    in >> arg;
+    if (name.empty() || (in >> extra)) {
+        return false;
+    }
+    if (kind == "prefix" && !arg.empty()) {
+        key_rule &rule = rule_for(prefix_trie, name);
+        rule.prefix = true;
+        rule.to = arg;
+    } else if (kind == "drop" && arg.empty()) {
+        rule_for(prefix_trie, name).drop = true;
+    } else if (kind == "rename" && !arg.empty()) {
+        key_rule &rule = rule_for(component_trie, name);
+        rule.rename = true;
+        rule.to = arg;
+    } else if (kind == "plural" && arg.empty()) {
+        if (name == "*") {
+            plural_any = true;
+        } else {
+            rule_for(component_trie, name).plural = true;
+        }
+    } else if (kind == "offset" && !arg.empty()) {
+        char *end;
+        long offset = strtol(arg.c_str(), &end, 10);
+        if (*end) {
+            return false;
+        }
+        key_rule &rule = rule_for(component_trie, name);
+        rule.offset = true;
+        rule.index_offset = offset;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Compiles the metric key rules. Without rules, the default set keeps the
+ * historical mapping:
+ *
+ *     plural *
+ *     offset worker -1
+ *
+ * that is, components preceding an array index are pluralized (worker,
+ * core and socket become workers, cores and sockets), and worker ids,
+ * which are one-indexed because worker 0 stands for the master, become
+ * zero-indexed, with worker.0.<metric> landing at the document root.
+ * Returns false if a rule is invalid.
+ */
+bool compile_metric_rules(struct uwsgi_string_list *specs) {
+    struct uwsgi_string_list *usl;
+
+    rules_compiled = true;
+    if (!specs) {
+        add_rule("plural *");
+        add_rule("offset worker -1");
+        return true;
+    }
+    uwsgi_foreach(usl, specs) {
+        if (!add_rule(usl->value)) {
+            uwsgi_log("[stats-pusher-mongodb] invalid metric rule: %s\n", usl->value);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_index(const std::string &key, std::string::size_type pos) {
+    return pos < key.length() && std::isdigit(key[pos]);
+}
+
+/**
+ * Transforms invalid [1] metric keys (e.g. worker.1.core.0.requests) into
+ * JSON pointer notation [2] (e.g. "/workers/0/cores/0/requests"), used to
+ * set the value in the appropriate place in the stats JSON object, by
+ * applying the metric key rules (see compile_metric_rules()).
  *
  * The full stats JSON object contains structures that conveniently map onto
- * the metric keys. For instance, using the example above
- * (worker.1.core.0.requests), we find in the full stats object:
+ * the metric keys. For instance, using the example above, we find in the
+ * full stats object:
  *
  *     {
  *         "workers": [{
@@ -19,57 +158,75 @@ using json = nlohmann::json;
  *         }]
  *     }
  *
- * For metric key components that precede an array index, these must be
- * pluralized (worker, core, and socket become workers, cores, and sockets,
- * respectively).
- *
- * Also note that, in the above example of worker.1.core, the worker id is
- * one-indexed, not zero-indexed. This is because the overall stats apply to
- * the master worker. Thus worker.0.avg_response_time actually corresponds
- * to the JSON path /avg_response_time.
+ * Returns false if the metric is dropped by a rule.
  *
  * [1] In mongo-c-driver >= 1.6.0, documents with keys containing '.' are not
  *     permitted, since the resulting document is almost impossible to query:
  *     '.' is used in queries to indicate object nesting, and there is no way
  *     to escape the character.
  * [2] See https://tools.ietf.org/html/rfc6901
- * [3] See https://github.com/nlohmann/json#json-pointer-and-json-patch
  */
-static std::string metrics_key_to_json_pointer_path(std::string key) {
-    std::string path = "/";
-    path.reserve(key.length() + 2);
+static bool metrics_key_to_json_pointer_path(std::string key, std::string &path) {
+    if (!rules_compiled) {
+        compile_metric_rules(NULL);
+    }
 
-    std::string::size_type max = key.length() - 1;
-    std::string::size_type last = 0;
-    std::string::size_type pos, next;
+    // Longest matching prefix rule
+    int matched = -1;
+    std::size_t matched_len = 0;
+    std::size_t node = 0;
+    for (std::size_t i = 0; i < key.length(); i++) {
+        auto it = prefix_trie[node].next.find(key[i]);
+        if (it == prefix_trie[node].next.end()) break;
+        node = it->second;
+        if (prefix_trie[node].rule >= 0) {
+            matched = prefix_trie[node].rule;
+            matched_len = i + 1;
+        }
+    }
+    if (matched >= 0) {
+        if (rules[matched].drop) {
+            return false;
+        }
+        key = rules[matched].to + key.substr(matched_len);
+    }
 
-    std::string component;
+    path = "/";
+    path.reserve(key.length() + 2);
 
+    std::string::size_type last = 0, pos;
     while (std::string::npos != (pos = key.find(".", last))) {
-        component = key.substr(last, pos - last);
-
-        bool is_array_key = (pos < max && std::isdigit(key.at(pos + 1)));
-
-        if (is_array_key) {
-            component += "s";
-            if (component == "workers") {
-                // worker index fix
-                if (std::string::npos != (next = key.find(".", pos + 1))) {
-                    int worker_num = stoi(key.substr(pos + 1, next), nullptr, 10);
-                    // If worker == 0, don't append workers/0/ (since the stat
-                    // applies to the master worker), otherwise subtract 1 from
-                    // the worker id to make it zero-indexed
-                    if (worker_num == 0) {
-                        // append nothing, continue past the worker id
-                        last = next + 1;
-                        continue;
-                    } else {
-                        component += "/" + std::to_string(worker_num - 1);
-                        // Advance 'pos' past the worker id, so we don't
-                        // append it twice
-                        pos = next;
-                    }
+        std::string component = key.substr(last, pos - last);
+        const key_rule *rule = NULL;
+
+        node = 0;
+        for (char c : component) {
+            auto it = component_trie[node].next.find(c);
+            if (it == component_trie[node].next.end()) {
+                node = 0;
+                break;
+            }
+            node = it->second;
+        }
+        if (node && component_trie[node].rule >= 0) {
+            rule = &rules[component_trie[node].rule];
+        }
+
+        if (rule && rule->rename) {
+            component = rule->to;
+        }
+        if (is_index(key, pos + 1)) {
+            if (plural_any || (rule && rule->plural)) {
+                component += "s";
+            }
+            std::string::size_type next = key.find(".", pos + 1);
+            if (rule && rule->offset && next != std::string::npos) {
+                long index = strtol(key.c_str() + pos + 1, NULL, 10) + rule->index_offset;
+                last = next + 1;
+                if (index >= 0) {
+                    path += component + "/" + std::to_string(index) + "/";
                 }
+                continue;
             }
         }
 
@@ -78,30 +235,75 @@ static std::string metrics_key_to_json_pointer_path(std::string key) {
     }
     // Add remaining key after the last "."
     path += key.substr(last);
-    return path;
+    return true;
 }
 
-void transform_metrics(json &doc) {
-    auto metrics = doc["metrics"];
+/**
+ * The document path of a metric, computed once per metric name: parsing
+ * the key and applying the rules, then parsing the resulting pointer,
+ * costs more than setting the value. 'keep' is false for dropped keys.
+ */
+struct metric_path {
+    bool keep;
+    stats_path path;
+};
 
-    if (metrics.is_null()) {
+static std::unordered_map<std::string, metric_path> metric_paths;
+
+static const metric_path &metric_path_of(const std::string &name) {
+    auto it = metric_paths.find(name);
+    if (it != metric_paths.end()) {
+        return it->second;
+    }
+
+    metric_path mp = {false, stats_path()};
+    std::string path;
+    if (metrics_key_to_json_pointer_path(name, path)) {
+        try {
+            mp.path = stats_path_of(path);
+            mp.keep = true;
+        } catch (json::exception &exc) {
+            uwsgi_log("[stats-pusher-mongodb] invalid path for metric %s: %s\n",
+                      name.c_str(), exc.what());
+        }
+    }
+    return metric_paths.emplace(name, mp).first->second;
+}
+
+/**
+ * Moves the metric values of the "metrics" section of the stats document
+ * to their place in it, e.g. {"metrics": {"worker.1.requests":
+ * {"value": 12}}} to {"workers": [..., {"requests": 12}]}. Values come
+ * from the snapshot itself, so they are consistent with the rest of the
+ * document.
+ */
+void transform_metrics(stats_snapshot &snap) {
+    json &doc = snap.doc;
+    auto section = doc.find("metrics");
+    if (section == doc.end()) {
+        return;
+    }
+    json metrics = std::move(*section);
+    doc.erase(section);
+    if (!metrics.is_object()) {
         return;
     }
 
     for (json::iterator it = metrics.begin(); it != metrics.end(); ++it) {
-        std::string path = metrics_key_to_json_pointer_path(it.key());
-        auto value = it.value()["value"];
-        if (value.is_null()) {
+        const metric_path &mp = metric_path_of(it.key());
+        if (!mp.keep || !it.value().is_object()) {
+            continue;
+        }
+        auto value = it.value().find("value");
+        if (value == it.value().end() || value->is_null()) {
             continue;
         }
 
         try {
-            doc[json::json_pointer(path)] = value;
+            stats_set(snap, mp.path, std::move(*value));
         } catch (json::exception &exc) {
             uwsgi_log("[stats-pusher-mongodb] error setting json val for "
                       "metric %s: %s\n", it.key().c_str(), exc.what());
         }
     }
-
-    doc.erase("metrics");
 }
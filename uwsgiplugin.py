@@ -23,4 +23,9 @@ CFLAGS += pkgconfig_flags('cflags')
 LIBS = pkgconfig_flags('libs-only-l')
 LDFLAGS = pkgconfig_flags('libs-only-L')
 
-GCC_LIST = ['plugin.cc', 'transform_metrics.cc']
+GCC_LIST = ['plugin.cc', 'transform_metrics.cc', 'counters.cc',
+            'convert.cc', 'parse_stats.cc',
+            'scan.cc', 'sparse.cc',
+            'summary.cc', 'latency.cc',
+            'routes.cc', 'slow.cc',
+            'stats.cc']